@@ -2,19 +2,16 @@ LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
 
-# Ignore HCI_RESET in filter code
-# so that HCI_RESET happens only once
-# regardless of the client
-#LOCAL_CFLAGS += -DIGNORE_HCI_RESET
+# Packet hooks are enabled at runtime, by name, in vendor.wc_transport.hooks:
+#   ignore_reset    answer HCI_RESET in the filter so that it happens only
+#                   once regardless of the client
+#   mimic_cmd_tout  drop HCI_Write_Local_Name to mimic a cmd tout at the
+#                   host, debug only, DON'T ENABLE IT FOR NORMAL BT OPERATIONS
 
-# MIMIC cmd TOUT at filter
-# used to check the behavior of the system
-# by mimicing the cmd tout at host
-# this is only for debug purpose
-# DON'T ENABLE IT FOR NORMAL BT OPERATIONS
-#LOCAL_CFLAGS += -DDEBUG_MIMIC_CMD_TOUT
-
-LOCAL_SRC_FILES := src/main.c
+LOCAL_SRC_FILES := src/main.c \
+                   src/io_backend.c \
+                   src/shm_ring.c \
+                   src/hci_record.c
 
 LOCAL_CFLAGS += -Wall -Wextra # -Werror
 
@@ -26,3 +23,45 @@ LOCAL_MODULE_TAGS := optional
 LOCAL_VENDOR_MODULE := true
 
 include $(BUILD_EXECUTABLE)
+
+# The same core as a library the BT stack links in place of bt_sock,
+# see src/wcnss_filter.h
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := src/main.c \
+                   src/io_backend.c \
+                   src/shm_ring.c \
+                   src/hci_record.c
+
+LOCAL_CFLAGS += -Wall -Wextra -DWCNSS_FILTER_LIB # -Werror
+# Nothing but the wcnss_filter_* API is exported into the stack's process
+LOCAL_CFLAGS += -fvisibility=hidden
+
+LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)/src
+
+LOCAL_SHARED_LIBRARIES := libutils libcutils liblog
+
+LOCAL_MODULE := libwcnss_filter
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_VENDOR_MODULE := true
+
+include $(BUILD_SHARED_LIBRARY)
+
+# Replays sessions recorded with vendor.wc_transport.record_path
+# against wcnss_filter, see src/replay.c
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := src/replay.c \
+                   src/hci_record.c
+
+LOCAL_CFLAGS += -Wall -Wextra # -Werror
+
+LOCAL_SHARED_LIBRARIES := libcutils liblog
+
+LOCAL_MODULE := wcnss_replay
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_VENDOR_MODULE := true
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,172 @@
+/*==========================================================================
+Description
+  Session recording for wcnss_filter, see hci_record.h for the format.
+
+  Every thread appends under one mutex into a stdio buffer, so records land
+  in the file in timestamp order. The watchdog thread flushes the buffer
+  periodically; the threads moving packets never wait for the storage.
+
+===========================================================================*/
+
+#include <cutils/log.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "hci_record.h"
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+
+#define LOG_TAG "WCNSS_FILTER"
+
+#define HCI_REC_BUF_SIZE (256 * 1024)
+
+static pthread_mutex_t rec_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *rec_file;
+static char *rec_buf;
+static bool rec_active;
+static uint64_t rec_start_us;
+static size_t rec_written;
+static size_t rec_max_bytes;
+
+static uint64_t rec_now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int hci_record_open(const char *path, size_t max_bytes)
+{
+    struct hci_rec_file_hdr fh;
+
+    pthread_mutex_lock(&rec_mutex);
+    if (rec_file != NULL) {
+        pthread_mutex_unlock(&rec_mutex);
+        errno = EBUSY;
+        return -1;
+    }
+
+    rec_file = fopen(path, "we");
+    if (rec_file == NULL) {
+        pthread_mutex_unlock(&rec_mutex);
+        return -1;
+    }
+    rec_buf = malloc(HCI_REC_BUF_SIZE);
+    if (rec_buf != NULL)
+        setvbuf(rec_file, rec_buf, _IOFBF, HCI_REC_BUF_SIZE);
+
+    rec_start_us = rec_now_us();
+    memset(&fh, 0, sizeof(fh));
+    fh.magic = HCI_REC_MAGIC;
+    fh.version = HCI_REC_VERSION;
+    fh.rec_hdr_size = sizeof(struct hci_rec_hdr);
+    fh.start_us = rec_start_us;
+    fwrite(&fh, sizeof(fh), 1, rec_file);
+
+    rec_written = sizeof(fh);
+    rec_max_bytes = max_bytes;
+    __atomic_store_n(&rec_active, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rec_mutex);
+
+    ALOGI("%s: recording to %s", __func__, path);
+    return 0;
+}
+
+int hci_record_active()
+{
+    return __atomic_load_n(&rec_active, __ATOMIC_ACQUIRE);
+}
+
+void hci_record(uint8_t type, uint8_t instance, uint8_t chan, uint8_t dir,
+                const unsigned char *buf, int len)
+{
+    struct hci_rec_hdr hdr;
+
+    if (!hci_record_active() || len <= 0)
+        return;
+
+    pthread_mutex_lock(&rec_mutex);
+    if (!rec_active) {
+        pthread_mutex_unlock(&rec_mutex);
+        return;
+    }
+
+    if (rec_max_bytes && rec_written + sizeof(hdr) + len > rec_max_bytes) {
+        ALOGI("%s: recording reached %zu bytes, stopped", __func__, rec_written);
+        __atomic_store_n(&rec_active, false, __ATOMIC_RELEASE);
+        fflush(rec_file);
+        pthread_mutex_unlock(&rec_mutex);
+        return;
+    }
+
+    hdr.ts_us = rec_now_us() - rec_start_us;
+    hdr.len = len;
+    hdr.type = type;
+    hdr.instance = instance;
+    hdr.chan = chan;
+    hdr.dir = dir;
+    if (fwrite(&hdr, sizeof(hdr), 1, rec_file) != 1 ||
+        fwrite(buf, len, 1, rec_file) != 1) {
+        ALOGE("%s: write failed, recording stopped: %s", __func__, strerror(errno));
+        __atomic_store_n(&rec_active, false, __ATOMIC_RELEASE);
+    }
+    rec_written += sizeof(hdr) + len;
+    pthread_mutex_unlock(&rec_mutex);
+}
+
+void hci_record_flush()
+{
+    pthread_mutex_lock(&rec_mutex);
+    if (rec_file != NULL)
+        fflush(rec_file);
+    pthread_mutex_unlock(&rec_mutex);
+}
+
+void hci_record_close()
+{
+    pthread_mutex_lock(&rec_mutex);
+    __atomic_store_n(&rec_active, false, __ATOMIC_RELEASE);
+    if (rec_file != NULL) {
+        fclose(rec_file);
+        rec_file = NULL;
+    }
+    free(rec_buf);
+    rec_buf = NULL;
+    pthread_mutex_unlock(&rec_mutex);
+}
+
+int hci_record_read_header(FILE *f, struct hci_rec_file_hdr *fh)
+{
+    if (fread(fh, sizeof(*fh), 1, f) != 1)
+        return -1;
+    if (fh->magic != HCI_REC_MAGIC || fh->version != HCI_REC_VERSION ||
+        fh->rec_hdr_size != sizeof(struct hci_rec_hdr)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int hci_record_read(FILE *f, struct hci_rec_hdr *hdr, unsigned char *buf, size_t len)
+{
+    size_t n = fread(hdr, 1, sizeof(*hdr), f);
+
+    if (n == 0)
+        return 0;
+    if (n != sizeof(*hdr) || hdr->len > len) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (hdr->len && fread(buf, hdr->len, 1, f) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 1;
+}
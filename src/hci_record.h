@@ -0,0 +1,83 @@
+/*==========================================================================
+Description
+  Session recording for wcnss_filter (vendor.wc_transport.record_path).
+
+  A recording is a file header followed by records in the order the events
+  happened. Each record is a struct hci_rec_hdr and len bytes of data:
+
+  HCI_REC_UART_RX  bytes as they came out of one read of the UART
+  HCI_REC_HOST_RX  bytes as they came out of one read of a client socket, or
+                   one packet taken from the client's shared-memory ring
+  HCI_REC_PACKET   one packet as the framing code delimited it, with the bytes
+                   handed to the other side
+
+  wcnss_replay (replay.c) feeds the *_RX records back into a filter and checks
+  its output against the HCI_REC_PACKET ones. All fields are host endian.
+
+===========================================================================*/
+
+#ifndef WCNSS_FILTER_HCI_RECORD_H
+#define WCNSS_FILTER_HCI_RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define HCI_REC_MAGIC    0x43524357  /* "WCRC" */
+#define HCI_REC_VERSION  1
+
+enum {
+    HCI_REC_UART_RX = 1,
+    HCI_REC_HOST_RX,
+    HCI_REC_PACKET,
+};
+
+/* hci_rec_hdr.chan: where the bytes came from, or went to for packets
+ * travelling towards a client
+ */
+enum {
+    HCI_REC_CHAN_UART = 0,
+    HCI_REC_CHAN_BT,
+    HCI_REC_CHAN_ANT,
+};
+
+/* hci_rec_hdr.dir, same values as the filter's HOST_TO_SOC/SOC_TO_HOST */
+enum {
+    HCI_REC_HOST_TO_SOC = 0,
+    HCI_REC_SOC_TO_HOST,
+};
+
+struct hci_rec_file_hdr {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_hdr_size;  /* sizeof(struct hci_rec_hdr) */
+    uint64_t start_us;      /* CLOCK_MONOTONIC when the recording started */
+};
+
+struct hci_rec_hdr {
+    uint64_t ts_us;         /* since start_us */
+    uint32_t len;
+    uint8_t type;
+    uint8_t instance;       /* filter instance index */
+    uint8_t chan;
+    uint8_t dir;
+};
+
+/* Starts recording to path, stopping once max_bytes were written (0 for no
+ * limit). Returns 0 or -1 with errno set.
+ */
+int hci_record_open(const char *path, size_t max_bytes);
+int hci_record_active();
+void hci_record(uint8_t type, uint8_t instance, uint8_t chan, uint8_t dir,
+                const unsigned char *buf, int len);
+/* Pushes buffered records to the file */
+void hci_record_flush();
+void hci_record_close();
+
+/* Reader side. hci_record_read() returns 1 with the record in hdr/buf,
+ * 0 at the end of the file, -1 on a truncated or oversized record.
+ */
+int hci_record_read_header(FILE *f, struct hci_rec_file_hdr *fh);
+int hci_record_read(FILE *f, struct hci_rec_hdr *hdr, unsigned char *buf, size_t len);
+
+#endif //WCNSS_FILTER_HCI_RECORD_H
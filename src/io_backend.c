@@ -0,0 +1,1092 @@
+/*==========================================================================
+Description
+  I/O backends used by wcnss_filter to move bytes between the UART transport
+  and the client sockets.
+
+  select: the classic select()/read()/write() path, one syscall per header
+          and payload read.
+  io_uring: every thread owns a small ring. Reads on the fd the thread serves
+          stay armed into one of two registered buffers while the framing code
+          consumes the other, so one completion typically carries several
+          packets. Writes are staged into a registered buffer and submitted as
+          one linked batch before the thread blocks again.
+
+===========================================================================*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <cutils/log.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "io_backend.h"
+
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+
+#define LOG_TAG "WCNSS_FILTER"
+
+#define STAT_ADD(field, val) __atomic_fetch_add(&io_stats.field, (val), __ATOMIC_RELAXED)
+
+static enum io_backend_type backend = IO_BACKEND_SELECT;
+#define IO_MAX_BATCH_FDS 8
+
+static __thread pthread_mutex_t *io_write_lock;
+static struct io_stats io_stats;
+static io_rx_tap_fn rx_tap;
+
+static struct {
+    int fd;
+    size_t len;
+} read_batch[IO_MAX_BATCH_FDS];
+static pthread_mutex_t read_batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bytes handed over from another process, served before fd is read again */
+static struct {
+    int fd;
+    unsigned char *buf;
+    size_t off, len;
+} primed[IO_MAX_PRIMED_FDS];
+static int nprimed;
+static pthread_mutex_t primed_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t get_read_batch(int fd)
+{
+    size_t len = 0;
+    int i;
+
+    pthread_mutex_lock(&read_batch_mutex);
+    for (i = 0; i < IO_MAX_BATCH_FDS; i++) {
+        if (read_batch[i].len && read_batch[i].fd == fd) {
+            len = read_batch[i].len;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&read_batch_mutex);
+    return len;
+}
+
+/* Takes what is left of fd's primed bytes out of the table */
+static unsigned char *primed_take(int fd, size_t *len)
+{
+    unsigned char *buf = NULL;
+    int i;
+
+    *len = 0;
+    pthread_mutex_lock(&primed_mutex);
+    for (i = 0; i < IO_MAX_PRIMED_FDS; i++) {
+        if (primed[i].buf == NULL || primed[i].fd != fd)
+            continue;
+        *len = primed[i].len - primed[i].off;
+        buf = primed[i].buf;
+        memmove(buf, buf + primed[i].off, *len);
+        primed[i].buf = NULL;
+        __atomic_fetch_sub(&nprimed, 1, __ATOMIC_RELEASE);
+        break;
+    }
+    pthread_mutex_unlock(&primed_mutex);
+    return buf;
+}
+
+static bool primed_pending(int fd)
+{
+    bool ret = false;
+    int i;
+
+    if (__atomic_load_n(&nprimed, __ATOMIC_ACQUIRE) == 0)
+        return false;
+
+    pthread_mutex_lock(&primed_mutex);
+    for (i = 0; i < IO_MAX_PRIMED_FDS; i++) {
+        if (primed[i].buf != NULL && primed[i].fd == fd) {
+            ret = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&primed_mutex);
+    return ret;
+}
+
+/* Returns 0 once fd has no primed bytes (left) */
+static int primed_read(int fd, unsigned char *buf, size_t len)
+{
+    size_t n = 0;
+    int i;
+
+    if (__atomic_load_n(&nprimed, __ATOMIC_ACQUIRE) == 0)
+        return 0;
+
+    pthread_mutex_lock(&primed_mutex);
+    for (i = 0; i < IO_MAX_PRIMED_FDS; i++) {
+        if (primed[i].buf == NULL || primed[i].fd != fd)
+            continue;
+        n = primed[i].len - primed[i].off;
+        if (n > len)
+            n = len;
+        memcpy(buf, primed[i].buf + primed[i].off, n);
+        primed[i].off += n;
+        if (primed[i].off == primed[i].len) {
+            free(primed[i].buf);
+            primed[i].buf = NULL;
+            __atomic_fetch_sub(&nprimed, 1, __ATOMIC_RELEASE);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&primed_mutex);
+
+    /* Recorded again, a recording of this process starts with them */
+    if (n > 0 && rx_tap)
+        rx_tap(fd, buf, n);
+    return n;
+}
+
+static int write_all(int fd, unsigned char *buf, size_t len)
+{
+    size_t off = 0;
+    int ret;
+
+    while (off < len) {
+        ret = write(fd, buf + off, len - off);
+        STAT_ADD(write_calls, 1);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ret == 0)
+            break;
+        STAT_ADD(tx_bytes, ret);
+        off += ret;
+    }
+    return off;
+}
+
+static int select_wait_readable(int fd, int timeout_us)
+{
+    fd_set input;
+    struct timeval tv;
+
+    FD_ZERO(&input);
+    FD_SET(fd, &input);
+    tv.tv_sec = timeout_us / 1000000;
+    tv.tv_usec = timeout_us % 1000000;
+    STAT_ADD(wait_calls, 1);
+    return select(fd+1, &input, NULL, NULL, timeout_us < 0 ? NULL : &tv);
+}
+
+static int select_read(int fd, unsigned char *buf, size_t len)
+{
+    int ret = read(fd, buf, len);
+
+    STAT_ADD(read_calls, 1);
+    if (ret > 0) {
+        STAT_ADD(rx_bytes, ret);
+        if (rx_tap)
+            rx_tap(fd, buf, ret);
+    }
+    return ret;
+}
+
+static int select_write(int fd, unsigned char *buf, size_t len)
+{
+    int ret = write(fd, buf, len);
+
+    STAT_ADD(write_calls, 1);
+    if (ret > 0)
+        STAT_ADD(tx_bytes, ret);
+    return ret;
+}
+
+static int select_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    int ret, done = 0;
+
+    while (iovcnt > 0) {
+        ret = writev(fd, iov, iovcnt);
+        STAT_ADD(write_calls, 1);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        STAT_ADD(tx_bytes, ret);
+        done += ret;
+        /* Short write, skip what went out */
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (unsigned char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return done;
+}
+
+#ifdef HAVE_IO_URING
+
+#define URING_ENTRIES   8
+#define URING_RX_BUF    4096
+#define URING_TX_BUF    8192
+#define URING_TX_SLOTS  4
+
+#define URING_BUF_TX    2
+#define URING_UD_READ   1
+#define URING_UD_CANCEL 2
+#define URING_UD_WRITE  0x100
+
+struct uring_ctx {
+    int ring_fd;
+    /* fd reads are armed on, -1 until the thread first waits/reads */
+    int fd;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+    unsigned to_submit;
+
+    /* rx[cur] is being consumed, the armed read targets rx[!cur] */
+    unsigned char rx[2][URING_RX_BUF];
+    int cur;
+    size_t rx_off, rx_len;
+    bool armed, armed_done, eof;
+    int armed_res;
+
+    unsigned char tx[URING_TX_BUF];
+    size_t tx_len;
+    struct {
+        int fd;
+        size_t off, len;
+        int res;
+    } slot[URING_TX_SLOTS];
+    int nslots, writes_inflight;
+    /* the owner's io_write_lock, held whenever the slots change */
+    pthread_mutex_t *write_lock;
+    /* listed in stagers[] */
+    bool staged;
+};
+
+static __thread struct uring_ctx *uring;
+/* set when this thread could not get a ring, it then uses plain syscalls */
+static __thread bool uring_failed;
+
+/* Rings holding staged writes. Staging is per thread, so before writing to
+ * a fd a thread pushes out what other threads staged for it, or its bytes
+ * would overtake theirs.
+ */
+#define URING_MAX_STAGERS 32
+static struct uring_ctx *stagers[URING_MAX_STAGERS];
+static int nstagers;
+static pthread_mutex_t stagers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_unstage(struct uring_ctx *ctx);
+
+static void uring_destroy(struct uring_ctx *ctx)
+{
+    uring_unstage(ctx);
+    if (ctx->sqes && ctx->sqes != MAP_FAILED)
+        munmap(ctx->sqes, ctx->sqes_sz);
+    if (ctx->cq_ring && ctx->cq_ring != MAP_FAILED && ctx->cq_ring != ctx->sq_ring)
+        munmap(ctx->cq_ring, ctx->cq_ring_sz);
+    if (ctx->sq_ring && ctx->sq_ring != MAP_FAILED)
+        munmap(ctx->sq_ring, ctx->sq_ring_sz);
+    /* Closing the ring cancels a read still armed on a dead fd */
+    if (ctx->ring_fd >= 0)
+        close(ctx->ring_fd);
+    free(ctx);
+}
+
+static struct uring_ctx *uring_create()
+{
+    struct io_uring_params p;
+    struct uring_ctx *ctx;
+    struct iovec iov[3];
+
+    ctx = (struct uring_ctx*)calloc(1, sizeof(*ctx));
+    if (ctx == NULL)
+        return NULL;
+    ctx->fd = -1;
+
+    memset(&p, 0, sizeof(p));
+    ctx->ring_fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (ctx->ring_fd < 0) {
+        ALOGE("%s: io_uring_setup failed: %s", __func__, strerror(errno));
+        free(ctx);
+        return NULL;
+    }
+
+    ctx->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ctx->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ctx->cq_ring_sz > ctx->sq_ring_sz)
+            ctx->sq_ring_sz = ctx->cq_ring_sz;
+        ctx->cq_ring_sz = ctx->sq_ring_sz;
+    }
+
+    ctx->sq_ring = mmap(NULL, ctx->sq_ring_sz, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ctx->ring_fd, IORING_OFF_SQ_RING);
+    if (ctx->sq_ring == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ctx->cq_ring = ctx->sq_ring;
+    else
+        ctx->cq_ring = mmap(NULL, ctx->cq_ring_sz, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ctx->ring_fd, IORING_OFF_CQ_RING);
+    if (ctx->cq_ring == MAP_FAILED)
+        goto fail;
+
+    ctx->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ctx->sqes = (struct io_uring_sqe*)mmap(NULL, ctx->sqes_sz, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ctx->ring_fd, IORING_OFF_SQES);
+    if (ctx->sqes == MAP_FAILED)
+        goto fail;
+
+    ctx->sq_head = (unsigned*)((char*)ctx->sq_ring + p.sq_off.head);
+    ctx->sq_tail = (unsigned*)((char*)ctx->sq_ring + p.sq_off.tail);
+    ctx->sq_mask = (unsigned*)((char*)ctx->sq_ring + p.sq_off.ring_mask);
+    ctx->sq_array = (unsigned*)((char*)ctx->sq_ring + p.sq_off.array);
+    ctx->cq_head = (unsigned*)((char*)ctx->cq_ring + p.cq_off.head);
+    ctx->cq_tail = (unsigned*)((char*)ctx->cq_ring + p.cq_off.tail);
+    ctx->cq_mask = (unsigned*)((char*)ctx->cq_ring + p.cq_off.ring_mask);
+    ctx->cqes = (struct io_uring_cqe*)((char*)ctx->cq_ring + p.cq_off.cqes);
+
+    iov[0].iov_base = ctx->rx[0];
+    iov[0].iov_len = URING_RX_BUF;
+    iov[1].iov_base = ctx->rx[1];
+    iov[1].iov_len = URING_RX_BUF;
+    iov[URING_BUF_TX].iov_base = ctx->tx;
+    iov[URING_BUF_TX].iov_len = URING_TX_BUF;
+    if (sys_io_uring_register(ctx->ring_fd, IORING_REGISTER_BUFFERS, iov, 3) < 0) {
+        ALOGE("%s: unable to register buffers: %s", __func__, strerror(errno));
+        goto fail;
+    }
+
+    return ctx;
+
+fail:
+    ALOGE("%s: io_uring ring setup failed: %s", __func__, strerror(errno));
+    uring_destroy(ctx);
+    return NULL;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring_ctx *ctx)
+{
+    unsigned tail = *ctx->sq_tail;
+    unsigned idx;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(ctx->sq_head, __ATOMIC_ACQUIRE) >= URING_ENTRIES)
+        return NULL;
+
+    idx = tail & *ctx->sq_mask;
+    sqe = &ctx->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ctx->sq_array[idx] = idx;
+    __atomic_store_n(ctx->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ctx->to_submit++;
+    return sqe;
+}
+
+static void uring_reap(struct uring_ctx *ctx)
+{
+    unsigned head = *ctx->cq_head;
+    struct io_uring_cqe *cqe;
+    int i;
+
+    while (head != __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &ctx->cqes[head & *ctx->cq_mask];
+        if (cqe->user_data == URING_UD_READ) {
+            ctx->armed_done = true;
+            ctx->armed_res = cqe->res;
+            STAT_ADD(read_calls, 1);
+            if (cqe->res > 0)
+                STAT_ADD(rx_bytes, cqe->res);
+        } else if (cqe->user_data >= URING_UD_WRITE) {
+            i = cqe->user_data - URING_UD_WRITE;
+            ctx->slot[i].res = cqe->res;
+            ctx->writes_inflight--;
+            STAT_ADD(write_calls, 1);
+            if (cqe->res > 0)
+                STAT_ADD(tx_bytes, cqe->res);
+        }
+        head++;
+    }
+    __atomic_store_n(ctx->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Submits whatever is queued and, if wait is set, blocks for one completion */
+static int uring_enter(struct uring_ctx *ctx, bool wait)
+{
+    int ret;
+
+    ret = sys_io_uring_enter(ctx->ring_fd, ctx->to_submit, wait ? 1 : 0,
+                             wait ? IORING_ENTER_GETEVENTS : 0);
+    if (wait)
+        STAT_ADD(wait_calls, 1);
+    else
+        STAT_ADD(submit_calls, 1);
+    if (ret < 0)
+        return -1;
+
+    ctx->to_submit -= (unsigned)ret < ctx->to_submit ? (unsigned)ret : ctx->to_submit;
+    uring_reap(ctx);
+    return 0;
+}
+
+static int uring_arm_read(struct uring_ctx *ctx)
+{
+    struct io_uring_sqe *sqe;
+    int idx = !ctx->cur;
+    size_t len = URING_RX_BUF;
+
+    if (ctx->armed || ctx->eof)
+        return 0;
+
+    len = get_read_batch(ctx->fd);
+    if (len == 0 || len > URING_RX_BUF)
+        len = URING_RX_BUF;
+
+    sqe = uring_get_sqe(ctx);
+    if (sqe == NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = ctx->fd;
+    sqe->addr = (uint64_t)(uintptr_t)ctx->rx[idx];
+    sqe->len = len;
+    sqe->buf_index = idx;
+    sqe->user_data = URING_UD_READ;
+
+    ctx->armed = true;
+    ctx->armed_done = false;
+    /* Hand it to the kernel now so it fills while the other buffer is parsed */
+    return uring_enter(ctx, false);
+}
+
+/* Writes out the staged slots in order. The ring may not have an SQE for
+ * each: what fits goes out as one linked round, completed before the next
+ * round is prepared, so no slot reaches its fd ahead of an earlier one.
+ */
+static int uring_flush_locked(struct uring_ctx *ctx)
+{
+    struct io_uring_sqe *sqe, *last;
+    int i, first, end, ret = 0, res;
+
+    if (ctx->nslots == 0)
+        return 0;
+
+    for (first = 0; ret == 0 && first < ctx->nslots; first = end) {
+        last = NULL;
+        for (end = first; end < ctx->nslots; end++) {
+            sqe = uring_get_sqe(ctx);
+            if (sqe == NULL)
+                break;
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->fd = ctx->slot[end].fd;
+            sqe->addr = (uint64_t)(uintptr_t)(ctx->tx + ctx->slot[end].off);
+            sqe->len = ctx->slot[end].len;
+            sqe->buf_index = URING_BUF_TX;
+            sqe->user_data = URING_UD_WRITE + end;
+            /* Keep batch order, two slots may target the same fd */
+            sqe->flags |= IOSQE_IO_LINK;
+            ctx->writes_inflight++;
+            last = sqe;
+        }
+        if (last != NULL) {
+            /* The chain ends with the round */
+            last->flags &= ~IOSQE_IO_LINK;
+        } else {
+            /* Not a single SQE to be had, the rest goes out synchronously */
+            for (end = first; end < ctx->nslots; end++)
+                ctx->slot[end].res = -ECANCELED;
+        }
+
+        while (ctx->writes_inflight > 0) {
+            if (uring_enter(ctx, true) < 0 && errno != EINTR) {
+                ALOGE("%s: io_uring_enter failed: %s", __func__, strerror(errno));
+                ret = -1;
+                break;
+            }
+        }
+
+        /* Short, interrupted or cancelled writes in the chain are finished
+         * synchronously; a tty write may well end with -EINTR
+         */
+        for (i = first; ret == 0 && i < end; i++) {
+            res = ctx->slot[i].res;
+            if (res == (int)ctx->slot[i].len)
+                continue;
+            if (res < 0 && res != -ECANCELED && res != -EAGAIN && res != -EINTR) {
+                errno = -res;
+                ALOGE("%s: write to fd %d failed: %s", __func__, ctx->slot[i].fd,
+                      strerror(errno));
+                ret = -1;
+                continue;
+            }
+            if (res < 0)
+                res = 0;
+            if (write_all(ctx->slot[i].fd, ctx->tx + ctx->slot[i].off + res,
+                          ctx->slot[i].len - res) < 0)
+                ret = -1;
+        }
+    }
+
+    ctx->nslots = 0;
+    ctx->tx_len = 0;
+    uring_unstage(ctx);
+    return ret;
+}
+
+/* ctx has no staged writes any more */
+static void uring_unstage(struct uring_ctx *ctx)
+{
+    int i;
+
+    if (!ctx->staged)
+        return;
+
+    pthread_mutex_lock(&stagers_mutex);
+    for (i = 0; i < URING_MAX_STAGERS; i++) {
+        if (stagers[i] == ctx) {
+            stagers[i] = NULL;
+            __atomic_fetch_sub(&nstagers, 1, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    ctx->staged = false;
+    pthread_mutex_unlock(&stagers_mutex);
+}
+
+/* Pushes out, from the calling thread, what other threads serialized by the
+ * same write lock staged for fd. Their slots only change under that lock,
+ * which the caller holds.
+ */
+static void uring_flush_others(int fd)
+{
+    struct uring_ctx *ctx;
+    int i, j;
+
+    if (__atomic_load_n(&nstagers, __ATOMIC_ACQUIRE) <= (uring && uring->staged ? 1 : 0))
+        return;
+
+    pthread_mutex_lock(&stagers_mutex);
+    for (i = 0; i < URING_MAX_STAGERS; i++) {
+        ctx = stagers[i];
+        if (ctx == NULL || ctx == uring || ctx->write_lock != io_write_lock)
+            continue;
+        for (j = 0; j < ctx->nslots && ctx->slot[j].fd != fd; j++)
+            ;
+        if (j == ctx->nslots)
+            continue;
+        /* All of it, in order: slots to other fds may follow this one */
+        for (j = 0; j < ctx->nslots; j++) {
+            if (write_all(ctx->slot[j].fd, ctx->tx + ctx->slot[j].off, ctx->slot[j].len) < 0)
+                ALOGE("%s: write to fd %d failed: %s", __func__, ctx->slot[j].fd,
+                      strerror(errno));
+        }
+        ctx->nslots = 0;
+        ctx->tx_len = 0;
+        ctx->staged = false;
+        stagers[i] = NULL;
+        __atomic_fetch_sub(&nstagers, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&stagers_mutex);
+}
+
+static struct uring_ctx *uring_get()
+{
+    if (uring == NULL && !uring_failed) {
+        uring = uring_create();
+        if (uring == NULL) {
+            ALOGE("%s: thread falls back to select/read/write", __func__);
+            uring_failed = true;
+        }
+    }
+    return uring;
+}
+
+/* Binds the armed read of this thread to fd */
+static struct uring_ctx *uring_bind(int fd)
+{
+    struct uring_ctx *ctx = uring_get();
+
+    if (ctx == NULL || ctx->fd == fd)
+        return ctx;
+
+    if (ctx->fd >= 0) {
+        /* The thread moved on to a new client/transport fd */
+        io_close(-1);
+        ctx = uring_get();
+        if (ctx == NULL)
+            return NULL;
+    }
+    ctx->fd = fd;
+    return ctx;
+}
+
+/* Returns 1 once the armed read completed, 0 if timeout_us (>= 0) ran out */
+static int uring_wait_armed(struct uring_ctx *ctx, int timeout_us)
+{
+    struct pollfd pfd;
+    struct timespec ts;
+    int ret;
+
+    if (uring_arm_read(ctx) < 0)
+        return -1;
+    while (!ctx->armed_done) {
+        if (timeout_us < 0) {
+            if (uring_enter(ctx, true) < 0)
+                return -1;
+            continue;
+        }
+        /* The ring fd turns readable when completions are posted */
+        pfd.fd = ctx->ring_fd;
+        pfd.events = POLLIN;
+        STAT_ADD(wait_calls, 1);
+        ts.tv_sec = timeout_us / 1000000;
+        ts.tv_nsec = (long)(timeout_us % 1000000) * 1000;
+        ret = ppoll(&pfd, 1, &ts, NULL);
+        if (ret < 0)
+            return -1;
+        if (ret == 0)
+            return 0;
+        uring_reap(ctx);
+        /* Only ever waits once, a completion for anything else ends it too */
+        timeout_us = 0;
+    }
+    return 1;
+}
+
+static int uring_wait_readable(struct uring_ctx *ctx, int timeout_us)
+{
+    /* Keep batching while there are buffered packets left to parse */
+    if (ctx->rx_off < ctx->rx_len || ctx->eof)
+        return 1;
+
+    if (ctx->nslots)
+        io_flush();
+    return uring_wait_armed(ctx, timeout_us);
+}
+
+static int uring_read(struct uring_ctx *ctx, unsigned char *buf, size_t len)
+{
+    size_t n;
+
+    if (ctx->rx_off == ctx->rx_len) {
+        if (ctx->eof)
+            return 0;
+        if (ctx->nslots)
+            io_flush();
+        if (uring_wait_armed(ctx, -1) < 0)
+            return -1;
+
+        ctx->armed = false;
+        if (ctx->armed_res <= 0) {
+            if (ctx->armed_res == 0) {
+                ctx->eof = true;
+                return 0;
+            }
+            errno = -ctx->armed_res;
+            return -1;
+        }
+        ctx->cur = !ctx->cur;
+        ctx->rx_off = 0;
+        ctx->rx_len = ctx->armed_res;
+        if (rx_tap)
+            rx_tap(ctx->fd, ctx->rx[ctx->cur], ctx->rx_len);
+        /* Re-arm into the buffer just drained */
+        if (uring_arm_read(ctx) < 0)
+            ALOGE("%s: unable to re-arm read: %s", __func__, strerror(errno));
+    }
+
+    n = ctx->rx_len - ctx->rx_off;
+    if (n > len)
+        n = len;
+    memcpy(buf, ctx->rx[ctx->cur] + ctx->rx_off, n);
+    ctx->rx_off += n;
+    return n;
+}
+
+/* Cancels the armed read and appends what was buffered or read by it */
+static int uring_detach(struct uring_ctx *ctx, unsigned char *buf)
+{
+    struct io_uring_sqe *sqe;
+    size_t len = ctx->rx_len - ctx->rx_off;
+
+    memcpy(buf, ctx->rx[ctx->cur] + ctx->rx_off, len);
+    ctx->rx_off = ctx->rx_len;
+    if (!ctx->armed)
+        return len;
+
+    if (!ctx->armed_done) {
+        sqe = uring_get_sqe(ctx);
+        if (sqe == NULL) {
+            errno = EBUSY;
+            return -1;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_UD_READ;
+        sqe->user_data = URING_UD_CANCEL;
+        /* The read may still complete with data instead, wait for its result */
+        while (!ctx->armed_done) {
+            if (uring_enter(ctx, true) < 0 && errno != EINTR)
+                return -1;
+        }
+    }
+    ctx->armed = false;
+    if (ctx->armed_res > 0) {
+        memcpy(buf + len, ctx->rx[!ctx->cur], ctx->armed_res);
+        if (rx_tap)
+            rx_tap(ctx->fd, buf + len, ctx->armed_res);
+        len += ctx->armed_res;
+    }
+    return len;
+}
+
+static int uring_stage(struct uring_ctx *ctx, int fd, unsigned char *buf, size_t len)
+{
+    int last = ctx->nslots - 1;
+
+    if (ctx->tx_len + len > URING_TX_BUF ||
+        (ctx->nslots == URING_TX_SLOTS && ctx->slot[last].fd != fd)) {
+        uring_flush_locked(ctx);
+        last = -1;
+    }
+
+    if (len > URING_TX_BUF)
+        return write_all(fd, buf, len);
+
+    if (!ctx->staged) {
+        int i;
+
+        ctx->write_lock = io_write_lock;
+        pthread_mutex_lock(&stagers_mutex);
+        for (i = 0; i < URING_MAX_STAGERS && stagers[i] != NULL; i++)
+            ;
+        if (i == URING_MAX_STAGERS) {
+            /* Nobody could keep order with us, go now */
+            pthread_mutex_unlock(&stagers_mutex);
+            return write_all(fd, buf, len);
+        }
+        stagers[i] = ctx;
+        ctx->staged = true;
+        __atomic_fetch_add(&nstagers, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&stagers_mutex);
+    }
+
+    memcpy(ctx->tx + ctx->tx_len, buf, len);
+    if (last >= 0 && ctx->slot[last].fd == fd) {
+        ctx->slot[last].len += len;
+    } else {
+        last = ctx->nslots++;
+        ctx->slot[last].fd = fd;
+        ctx->slot[last].off = ctx->tx_len;
+        ctx->slot[last].len = len;
+    }
+    ctx->tx_len += len;
+    return len;
+}
+
+static int uring_write(struct uring_ctx *ctx, int fd, unsigned char *buf, size_t len)
+{
+    int ret = uring_stage(ctx, fd, buf, len);
+
+    /* Nothing more buffered to parse, nobody will batch with us: go now */
+    if (ret >= 0 && ctx->rx_off == ctx->rx_len)
+        uring_flush_locked(ctx);
+    return ret;
+}
+
+#endif //HAVE_IO_URING
+
+int io_backend_init(const char *value)
+{
+    if (!strcmp(value, "io_uring")) {
+#ifdef HAVE_IO_URING
+        struct uring_ctx *probe = uring_create();
+
+        if (probe != NULL) {
+            uring_destroy(probe);
+            backend = IO_BACKEND_URING;
+        } else {
+            ALOGE("%s: io_uring not supported by this kernel", __func__);
+        }
+#else
+        ALOGE("%s: io_uring support not built in", __func__);
+#endif
+    } else if (strcmp(value, "select")) {
+        ALOGE("%s: unknown io backend %s", __func__, value);
+    }
+
+    ALOGI("%s: using %s io backend", __func__, io_backend_name());
+    return backend;
+}
+
+void io_set_write_lock(pthread_mutex_t *write_lock)
+{
+    io_write_lock = write_lock;
+}
+
+void io_set_rx_tap(io_rx_tap_fn tap)
+{
+    rx_tap = tap;
+}
+
+enum io_backend_type io_backend_get_type()
+{
+    return backend;
+}
+
+const char *io_backend_name()
+{
+    return backend == IO_BACKEND_URING ? "io_uring" : "select";
+}
+
+int io_wait_readable(int fd)
+{
+    return io_wait_readable_timeout(fd, -1);
+}
+
+int io_wait_readable_timeout(int fd, int timeout_us)
+{
+#ifdef HAVE_IO_URING
+    struct uring_ctx *ctx;
+#endif
+
+    if (primed_pending(fd))
+        return 1;
+#ifdef HAVE_IO_URING
+
+    if (backend == IO_BACKEND_URING && (ctx = uring_bind(fd)) != NULL)
+        return uring_wait_readable(ctx, timeout_us);
+#endif
+    return select_wait_readable(fd, timeout_us);
+}
+
+int io_read(int fd, unsigned char *buf, size_t len)
+{
+#ifdef HAVE_IO_URING
+    struct uring_ctx *ctx;
+#endif
+    int ret = primed_read(fd, buf, len);
+
+    if (ret > 0)
+        return ret;
+#ifdef HAVE_IO_URING
+
+    if (backend == IO_BACKEND_URING && (ctx = uring_bind(fd)) != NULL)
+        return uring_read(ctx, buf, len);
+#endif
+    return select_read(fd, buf, len);
+}
+
+int io_write(int fd, unsigned char *buf, size_t len)
+{
+#ifdef HAVE_IO_URING
+    struct uring_ctx *ctx;
+
+    if (backend == IO_BACKEND_URING)
+        uring_flush_others(fd);
+    if (backend == IO_BACKEND_URING && (ctx = uring_get()) != NULL)
+        return uring_write(ctx, fd, buf, len);
+#endif
+    return select_write(fd, buf, len);
+}
+
+int io_writev(int fd, struct iovec *iov, int iovcnt)
+{
+#ifdef HAVE_IO_URING
+    struct uring_ctx *ctx;
+    int i, ret, done = 0;
+
+    if (backend == IO_BACKEND_URING)
+        uring_flush_others(fd);
+    /* Staged back to back they end up in one write as well */
+    if (backend == IO_BACKEND_URING && (ctx = uring_get()) != NULL) {
+        for (i = 0; i < iovcnt; i++) {
+            ret = uring_stage(ctx, fd, iov[i].iov_base, iov[i].iov_len);
+            if (ret < 0)
+                return -1;
+            done += ret;
+        }
+        if (ctx->rx_off == ctx->rx_len)
+            uring_flush_locked(ctx);
+        return done;
+    }
+#endif
+    return select_writev(fd, iov, iovcnt);
+}
+
+int io_flush()
+{
+#ifdef HAVE_IO_URING
+    int ret;
+
+    if (uring == NULL || uring->nslots == 0)
+        return 0;
+
+    pthread_mutex_lock(io_write_lock);
+    ret = uring_flush_locked(uring);
+    pthread_mutex_unlock(io_write_lock);
+    return ret;
+#else
+    return 0;
+#endif
+}
+
+void io_set_read_batch(int fd, size_t len)
+{
+    int i, slot = -1;
+
+    pthread_mutex_lock(&read_batch_mutex);
+    for (i = 0; i < IO_MAX_BATCH_FDS; i++) {
+        if (read_batch[i].len && read_batch[i].fd == fd) {
+            slot = i;
+            break;
+        }
+        if (!read_batch[i].len && slot < 0)
+            slot = i;
+    }
+    if (slot >= 0) {
+        read_batch[slot].fd = fd;
+        read_batch[slot].len = len;
+    } else {
+        ALOGE("%s: no room to batch reads on fd %d", __func__, fd);
+    }
+    pthread_mutex_unlock(&read_batch_mutex);
+}
+
+void io_close(int fd)
+{
+#ifdef HAVE_IO_URING
+    if (uring != NULL && (fd < 0 || uring->fd == fd)) {
+        io_flush();
+        uring_destroy(uring);
+        uring = NULL;
+    }
+#endif
+    if (fd >= 0) {
+        /* The number may come back for an unrelated fd */
+        if (get_read_batch(fd))
+            io_set_read_batch(fd, 0);
+        close(fd);
+    }
+}
+
+int io_detach_read(int fd, unsigned char **buf)
+{
+    unsigned char *pending;
+    size_t len;
+#ifdef HAVE_IO_URING
+    int ret;
+#endif
+
+    pending = primed_take(fd, &len);
+#ifdef HAVE_IO_URING
+    if (uring != NULL && uring->fd == fd) {
+        /* Room for the buffered batch and the one the armed read brings */
+        unsigned char *grown = realloc(pending, len + 2 * URING_RX_BUF);
+
+        if (grown == NULL) {
+            free(pending);
+            return -1;
+        }
+        pending = grown;
+        ret = uring_detach(uring, pending + len);
+        if (ret < 0) {
+            ALOGE("%s: unable to stop reading fd %d: %s", __func__, fd, strerror(errno));
+            free(pending);
+            return -1;
+        }
+        len += ret;
+        io_flush();
+        uring_destroy(uring);
+        uring = NULL;
+    }
+#endif
+    if (len == 0) {
+        free(pending);
+        pending = NULL;
+    }
+    *buf = pending;
+    return len;
+}
+
+int io_prime_read(int fd, const unsigned char *buf, size_t len)
+{
+    int i;
+
+    if (len == 0)
+        return 0;
+
+    pthread_mutex_lock(&primed_mutex);
+    for (i = 0; i < IO_MAX_PRIMED_FDS; i++) {
+        if (primed[i].buf == NULL)
+            break;
+    }
+    if (i == IO_MAX_PRIMED_FDS || (primed[i].buf = malloc(len)) == NULL) {
+        pthread_mutex_unlock(&primed_mutex);
+        ALOGE("%s: no room to prime fd %d", __func__, fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(primed[i].buf, buf, len);
+    primed[i].fd = fd;
+    primed[i].off = 0;
+    primed[i].len = len;
+    __atomic_fetch_add(&nprimed, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&primed_mutex);
+    return len;
+}
+
+void io_get_stats(struct io_stats *st)
+{
+    st->read_calls = __atomic_load_n(&io_stats.read_calls, __ATOMIC_RELAXED);
+    st->write_calls = __atomic_load_n(&io_stats.write_calls, __ATOMIC_RELAXED);
+    st->wait_calls = __atomic_load_n(&io_stats.wait_calls, __ATOMIC_RELAXED);
+    st->submit_calls = __atomic_load_n(&io_stats.submit_calls, __ATOMIC_RELAXED);
+    st->rx_bytes = __atomic_load_n(&io_stats.rx_bytes, __ATOMIC_RELAXED);
+    st->tx_bytes = __atomic_load_n(&io_stats.tx_bytes, __ATOMIC_RELAXED);
+}
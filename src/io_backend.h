@@ -0,0 +1,91 @@
+/*==========================================================================
+Description
+  I/O backend used by wcnss_filter to move bytes between the UART transport
+  and the client sockets.
+
+===========================================================================*/
+
+#ifndef WCNSS_FILTER_IO_BACKEND_H
+#define WCNSS_FILTER_IO_BACKEND_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+enum io_backend_type {
+    IO_BACKEND_SELECT = 0,
+    IO_BACKEND_URING,
+};
+
+struct io_stats {
+    uint64_t read_calls;    /* read() syscalls */
+    uint64_t write_calls;   /* write() syscalls */
+    uint64_t wait_calls;    /* select() or waiting io_uring_enter() */
+    uint64_t submit_calls;  /* non-waiting io_uring_enter() */
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+};
+
+/* Picks the backend by name (vendor.wc_transport.io_backend: "select" or
+ * "io_uring"), falling back to select when io_uring is unavailable.
+ */
+int io_backend_init(const char *name);
+enum io_backend_type io_backend_get_type();
+const char *io_backend_name();
+
+/* Sets the mutex that serializes the calling thread's writes to the
+ * UART/clients; every filter thread calls this before any other io_ call.
+ */
+void io_set_write_lock(pthread_mutex_t *write_lock);
+
+/* Called with what each read returned, before anyone consumes it. Set once
+ * before the filter threads start; NULL (the default) disables it.
+ */
+typedef void (*io_rx_tap_fn)(int fd, const unsigned char *buf, int len);
+void io_set_rx_tap(io_rx_tap_fn tap);
+
+/* Block until fd has data; staged writes of the calling thread are flushed
+ * first. Returns > 0 when readable, -1 with errno set otherwise (EINTR
+ * included).
+ */
+int io_wait_readable(int fd);
+
+/* Same, giving up after timeout_us (< 0 waits forever). Returns 0 then. */
+int io_wait_readable_timeout(int fd, int timeout_us);
+
+/* read()/write() semantics. io_write must be called with write_lock held;
+ * on io_uring it may only stage the bytes until the next io_flush().
+ */
+int io_read(int fd, unsigned char *buf, size_t len);
+int io_write(int fd, unsigned char *buf, size_t len);
+/* Writes all of iov, in order, as one write where the backend allows */
+int io_writev(int fd, struct iovec *iov, int iovcnt);
+int io_flush();
+
+/* Caps the size of each read armed on fd, 0 restores the default. Only the
+ * io_uring backend batches reads; select reads exactly what is asked for.
+ */
+void io_set_read_batch(int fd, size_t len);
+
+/* Drops any per-thread state bound to fd, then closes it */
+void io_close(int fd);
+
+/* Handover of fd to another process: the calling thread, which must be the
+ * one reading fd, stops reading it. Bytes already read from fd but not yet
+ * consumed are returned in *buf (malloc()ed, NULL if there are none).
+ * Returns their count or -1.
+ */
+int io_detach_read(int fd, unsigned char **buf);
+
+/* The next reads of fd hand out a copy of buf before anything read from fd
+ * itself, and fd counts as readable until then. Up to IO_MAX_PRIMED_FDS fds
+ * can be primed at a time, enough for every stream a handover carries.
+ */
+#define IO_MAX_PRIMED_FDS 12
+
+int io_prime_read(int fd, const unsigned char *buf, size_t len);
+
+void io_get_stats(struct io_stats *st);
+
+#endif //WCNSS_FILTER_IO_BACKEND_H
@@ -32,10 +32,53 @@ Description
  * transport.  These threads have the logic of closing of their ends as part of
  * client closure and start waiting for the connection for next client connection.
 
+ * Watchdog thread: This thread periodically checks the age of the oldest HCI
+ * command that is still waiting for a Command Complete/Status and how long the
+ * UART has been silent. If the controller stops answering, it interrupts the
+ * transport read thread, which then closes and re-initializes the UART in
+ * process and signals the clients with BT_SSR_TRIGGERED instead of tearing the
+ * whole filter down.
+
  * Writes to UART port is guarded with a mutex so that writes from different
  * clients would be synchronized as required.
+
+ * All threads wait, read and write through io_backend.c, which uses either
+ * select()/read()/write() or io_uring (vendor.wc_transport.io_backend).
+ * Clients may move their data path onto shared-memory rings (shm_ring.c,
+ * vendor.wc_transport.shm_ring); their socket then only carries control.
+ * Small host bound packets can be held for a few hundred microseconds and
+ * handed to socket clients in one writev() (vendor.wc_transport.coalesce_*).
+ * BT packets pass the hooks enabled in vendor.wc_transport.hooks (struct
+ * pkt_hook) before they are forwarded.
+ * Sessions can be recorded (hci_record.c, vendor.wc_transport.record_path)
+ * and replayed against a filter build with wcnss_replay. It runs the filter
+ * with its settings on the command line (-p name=value) instead of in the
+ * system properties.
+
+ * Diagnostics thread (vendor.wc_transport.diag): controller log and other
+ * vendor events picked by vendor.wc_transport.diag_events never reach the
+ * Bluetooth client. The reader thread queues them and this thread hands them
+ * to a diag_sock client or appends them to a rotating file.
+
+ * Handover thread (vendor.wc_transport.handover): a newly started filter
+ * connects to wcnss_filter_handover. This one stops every thread at a packet
+ * boundary, passes the UART, client and listening sockets over along with
+ * the bytes read but not forwarded yet, and exits. The new filter carries on
+ * without re-initializing the controller, clients stay connected.
+
+ * One process can serve several UARTs (vendor.wc_transport.uart_devices). Each
+ * one gets its own filter instance with the reader and client threads above,
+ * pinned to its own CPU; the watchdog thread is shared by all instances.
+
+ * Built with WCNSS_FILTER_LIB this is libwcnss_filter (wcnss_filter.h) instead:
+ * the BT stack links it and replaces the first instance's Bluetooth client
+ * thread with callbacks, everything else stays as described above.
 **/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <cutils/log.h>
 #include <sys/socket.h>
 #include <cutils/sockets.h>
@@ -47,9 +90,19 @@ Description
 #include <termios.h>
 #include <fcntl.h>
 #include <sys/un.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
 #include <cutils/properties.h>
 #include "private/android_filesystem_config.h"
 
+#include "hci_record.h"
+#include "io_backend.h"
+#include "shm_ring.h"
+#include "wcnss_filter.h"
+
 #ifdef LOG_TAG
 #undef LOG_TAG
 #endif
@@ -61,6 +114,12 @@ Description
 
 #define BT_HS_UART_DEVICE "/dev/ttySAC0"
 
+/* vendor.wc_transport.uart_devices: comma separated list of UARTs to serve,
+ * one filter instance each. Defaults to BT_HS_UART_DEVICE alone.
+ */
+#define UART_DEVICES_PROP "vendor.wc_transport.uart_devices"
+#define MAX_FILTER_INSTANCES 4
+
 #define BT_SSR_TRIGGERED 0xee
 
 #define BT_CMD_PACKET_TYPE 0x01
@@ -82,6 +141,93 @@ Description
 #define BT_EVT_HDR_LEN_OFFSET 1
 #define BT_CMD_HDR_LEN_OFFSET 2
 
+#define BT_EVT_CMD_CMPL   0x0e
+#define BT_EVT_CMD_STATUS 0x0f
+#define BT_EVT_HW_ERROR   0x10
+#define BT_EVT_VENDOR     0xff
+
+#define HCI_RESET                    0x0c03
+#define HCI_WRITE_LOCAL_NAME         0x0c13
+#define HCI_HOST_NUM_COMPLETED_PKTS  0x0c35
+#define HCI_READ_LOCAL_VERSION       0x1001
+#define HCI_READ_LOCAL_COMMANDS      0x1002
+#define HCI_READ_LOCAL_FEATURES      0x1003
+#define HCI_READ_LOCAL_EXT_FEATURES  0x1004
+#define HCI_READ_BUFFER_SIZE         0x1005
+#define HCI_READ_BD_ADDR             0x1009
+#define HCI_LE_READ_BUFFER_SIZE      0x2002
+#define HCI_LE_READ_LOCAL_FEATURES   0x2003
+
+/* Command Complete: num_hci_cmd_pkts, opcode, status */
+#define BT_EVT_CC_OPCODE_OFFSET 4
+#define BT_EVT_CC_STATUS_OFFSET 6
+#define BT_CMD_OPCODE_OFFSET    1
+#define HCI_OGF_VENDOR          0x3f
+
+#define RSP_CACHE_MAX_PARAMS 4
+
+/* Watchdog: a command unanswered for WDOG_CMD_TOUT_MS while the UART has
+ * been silent for WDOG_SILENCE_MS is treated as a stalled controller.
+ * Both stay well below the stack's own command timeout.
+ */
+#define WDOG_POLL_MS      250
+#define WDOG_CMD_TOUT_MS  2000
+#define WDOG_SILENCE_MS   1000
+/* The executable's; in library mode a free real-time signal is taken */
+#define WDOG_SIGNAL       SIGUSR1
+/* A recovery kicks the threads writing to the UART every WDOG_KICK_MS until
+ * it gets hold of it, and gives up after WDOG_RECOVER_LOCK_MS
+ */
+#define WDOG_KICK_MS         100
+#define WDOG_RECOVER_LOCK_MS 3000
+
+/* Threads of an instance, bits of filter_instance.threads_live */
+#define INST_THREAD_READER (1 << 0)
+#define INST_THREAD_BT     (1 << 1)
+#define INST_THREAD_ANT    (1 << 2)
+#define INST_THREAD_ACL    (1 << 3)
+
+/* Zero-copy ACL: payloads of at least ZC_MIN_ACL_LEN bytes are moved with
+ * splice() through a per-thread pipe instead of read()/write(). Shorter
+ * ones are cheaper to copy than to pay the extra splice syscalls for.
+ */
+#define ZC_MIN_ACL_LEN    256
+#define ZC_PIPE_SIZE      (256 * 1024)
+#define ZC_PAGE_SIZE      4096
+
+#define UART_PROFILE_PROP "vendor.wc_transport.uart_profile"
+
+/* Host ACL scheduling, see struct acl_sched */
+#define ACL_SCHED_MAX_FLOWS   16
+#define ACL_SCHED_QUANTUM     1024
+#define ACL_SCHED_MAX_QUEUED  (64 * 1024)
+#define ACL_HANDLE_MASK       0x0fff
+
+/* Coalescing of host bound packets, see struct coalescer */
+#define COALESCE_MAX_BYTES 4096
+#define COALESCE_MAX_PKTS  32
+
+/* Diagnostics channel, see struct diag_channel */
+#define DIAG_SOCK             "diag_sock"
+#define DIAG_QUEUE_SIZE       (256 * 1024)
+#define DIAG_EVENTS_DEFAULT   "0xff:0xdc"
+#define DIAG_PATH_DEFAULT     "/data/vendor/wcnss/diag.bin"
+#define DIAG_FILE_KB_DEFAULT  8192
+
+/* Shared-memory rings, per direction. Large enough for the biggest ACL */
+#define SHM_RING_SIZE     (128 * 1024)
+#define SHM_MAX_PKT       (1 + BT_ACL_HDR_SIZE + 0xffff)
+
+/* Handover to a newly started filter, see handover_send() */
+#define HANDOVER_SOCK         "wcnss_filter_handover"
+#define HANDOVER_MAGIC        0x4f444857  /* "WHDO" */
+#define HANDOVER_VERSION      2
+#define HANDOVER_QUIESCE_MS   1000
+#define HANDOVER_KICK_MS      10
+
+/* Session recording stops at vendor.wc_transport.record_max_kb */
+#define RECORD_MAX_KB_DEFAULT (64 * 1024)
+
 #define ANT_CMD_HDR_SIZE      2
 #define ANT_HDR_OFFSET_LEN    1
 
@@ -107,23 +253,738 @@ Description
 #define HOST_TO_SOC 0
 #define SOC_TO_HOST 1
 
-pthread_mutex_t signal_mutex;
-
-int remote_bt_fd;
-int remote_ant_fd;
-
-int fd_transport;
+static pthread_t wdog_thread;
+/* kicks threads out of blocking calls with EINTR */
+static int wdog_signal = WDOG_SIGNAL;
+
+struct wdog_state {
+    /* time of the oldest unanswered command, 0 if none */
+    volatile int64_t cmd_sent_ms;
+    /* it is a vendor command, a vendor specific event may answer it */
+    volatile bool vendor_cmd;
+    volatile int64_t last_rx_ms;
+    volatile sig_atomic_t recovery_requested;
+    unsigned int recoveries;
+    int64_t last_recovery_ms;
+};
+
+/* vendor.wc_transport.stats_interval_ms, 0 disables the periodic dump */
+static int stats_interval_ms;
+
+/* vendor.wc_transport.zero_copy */
+static bool zero_copy_enabled;
+static __thread int zc_pipe[2] = {-1, -1};
+static __thread int zc_pipe_slots;
+/* set once splice() refused this thread's source fd */
+static __thread bool zc_unsupported;
+static uint64_t zc_bytes;
+
+/* vendor.wc_transport.shm_ring: offer shared-memory rings to clients */
+static bool shm_ring_enabled;
+/* packets taken off a client ring land here */
+static __thread unsigned char *shm_pkt;
+
+/* UART profiles trade wakeups against latency. vmin/vtime go to termios,
+ * low_latency to the serial driver (ASYNC_LOW_LATENCY) and read_batch caps
+ * each read of the reader thread. Selected by vendor.wc_transport.uart_profile,
+ * re-checked by the watchdog so it can be switched while running.
+ */
+struct uart_profile {
+    const char *name;
+    cc_t vmin;
+    cc_t vtime;         /* inter-byte timeout, 1/10 s */
+    bool low_latency;
+    size_t read_batch;
+};
+
+static const struct uart_profile uart_profiles[] = {
+    /* what cfmakeraw() leaves us with */
+    { "default",     1,  0, false, 0 },
+    { "low-latency", 1,  0, true,  256 },
+    { "throughput",  1,  0, false, 4096 },
+    /* wait for 64 bytes or a 100 ms gap: fewest wakeups, worst latency */
+    { "power",       64, 1, false, 4096 },
+};
+
+struct uart_profile_stats {
+    int reader_tid;
+    uint64_t last_csw;
+    int64_t last_ms;
+    /* command -> Command Complete/Status round trips, us */
+    volatile int64_t cmd_sent_us;
+    uint64_t rtt_sum_us;
+    uint64_t rtt_max_us;
+    unsigned int rtt_count;
+};
+
+/* Controller answers to idempotent read commands, captured from the first
+ * Command Complete and replayed for identical commands until an HCI_Reset
+ * reaches the SoC, a vendor command (NVM download, BD address write) is
+ * sent or SSR. A reset answered by the ignore_reset hook keeps them.
+ */
+struct rsp_cache_entry {
+    unsigned short opcode;
+    bool pending;
+    bool valid;
+    unsigned char params_len;
+    unsigned char params[RSP_CACHE_MAX_PARAMS];
+    unsigned short evt_len;
+    unsigned char evt[1 + BT_EVT_HDR_SIZE + 255];
+};
+
+static const struct rsp_cache_entry rsp_cache_template[] = {
+    { .opcode = HCI_READ_LOCAL_VERSION },
+    { .opcode = HCI_READ_LOCAL_COMMANDS },
+    { .opcode = HCI_READ_LOCAL_FEATURES },
+    { .opcode = HCI_READ_LOCAL_EXT_FEATURES },
+    { .opcode = HCI_READ_BUFFER_SIZE },
+    { .opcode = HCI_READ_BD_ADDR },
+    { .opcode = HCI_LE_READ_BUFFER_SIZE },
+    { .opcode = HCI_LE_READ_LOCAL_FEATURES },
+};
+
+#define RSP_CACHE_ENTRIES (sizeof(rsp_cache_template)/sizeof(rsp_cache_template[0]))
+
+/* vendor.wc_transport.rsp_cache */
+static bool rsp_cache_enabled;
+
+/* Small host bound packets for one socket client, held for up to budget_us
+ * or until coalesce_bytes are queued and then delivered with one writev().
+ * Guarded by signal_mutex like every other write to the client.
+ */
+struct coalescer {
+    /* vendor.wc_transport.coalesce_bt_us/coalesce_ant_us, 0 is off */
+    int budget_us;
+    /* when the oldest held packet came in, 0 when empty */
+    int64_t first_us;
+    int npkts;
+    size_t len;
+    struct iovec iov[COALESCE_MAX_PKTS];
+    unsigned char buf[COALESCE_MAX_BYTES];
+};
+
+/* vendor.wc_transport.coalesce_bytes */
+static size_t coalesce_bytes;
+
+struct acl_pkt {
+    struct acl_pkt *next;
+    int64_t queued_us;
+    int len;
+    unsigned char data[];
+};
+
+/* One per connection handle seen from the host */
+struct acl_flow {
+    bool in_use;
+    unsigned short handle;
+    int weight;
+    int deficit;
+    struct acl_pkt *head;
+    struct acl_pkt *tail;
+    int queued;
+    /* since the last stats dump, except bytes */
+    uint64_t bytes;
+    unsigned int pkts;
+    uint64_t delay_sum_us;
+    uint64_t delay_max_us;
+};
+
+/* Deficit round robin over ACL connection handles. With it enabled
+ * (vendor.wc_transport.acl_sched) the client thread only queues host ACL
+ * and a sender thread picks what goes to the UART next, so a bulk link
+ * cannot starve e.g. an A2DP one. Each round a handle may send up to
+ * ACL_SCHED_QUANTUM * weight bytes, weights come from
+ * vendor.wc_transport.acl_weights ("handle:weight,..."). Commands, SCO
+ * and ANT are not queued.
+ */
+struct acl_sched {
+    bool enabled;
+    pthread_mutex_t lock;
+    /* sender waits for packets, the client thread for room */
+    pthread_cond_t cond;
+    struct acl_flow flows[ACL_SCHED_MAX_FLOWS];
+    int cur;
+    bool granted;
+    int queued;
+    pthread_t thread;
+};
+
+static struct {
+    unsigned short handle;
+    int weight;
+} acl_weights[ACL_SCHED_MAX_FLOWS];
+static int num_acl_weights;
+
+enum diag_mode {
+    DIAG_OFF = 0,
+    DIAG_SOCKET,
+    DIAG_FILE,
+};
+
+/* vendor.wc_transport.diag ("socket" or "file") */
+static enum diag_mode diag_mode;
+static char diag_path[PROPERTY_VALUE_MAX];
+static size_t diag_file_max;
+
+/* Where a controller event goes, indexed by event code */
+enum {
+    DIAG_ROUTE_HOST = 0,
+    DIAG_ROUTE_DIAG,
+    /* depends on the first parameter, see diag_sub_route */
+    DIAG_ROUTE_SUB,
+};
+static unsigned char diag_evt_route[256];
+static uint32_t diag_sub_route[256][256 / 32];
+
+/* Events diverted away from the BT client. The reader thread only copies
+ * them into queue; diag_thread writes them out, so a slow diag reader or
+ * storage costs dropped diagnostics but never stalls the UART.
+ */
+struct diag_channel {
+    char sock_name[16];
+    char path[PROPERTY_VALUE_MAX + 8];
+    /* diag_sock client or log file, -1 while there is none */
+    int fd;
+    size_t file_bytes;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char queue[DIAG_QUEUE_SIZE];
+    size_t head, tail, used;
+    pthread_t thread;
+
+    uint64_t pkts;
+    uint64_t bytes;
+    uint64_t dropped;
+};
+
+/* What an instance hands over, indexing handover_inst.fd. Bytes read past
+ * the last packet boundary go along for the first HANDOVER_STREAMS.
+ */
+enum {
+    HANDOVER_UART = 0,
+    HANDOVER_BT,
+    HANDOVER_ANT,
+    HANDOVER_BT_LISTEN,
+    HANDOVER_ANT_LISTEN,
+    HANDOVER_FDS,
+};
+#define HANDOVER_STREAMS (HANDOVER_ANT + 1)
+_Static_assert(IO_MAX_PRIMED_FDS >= MAX_FILTER_INSTANCES * HANDOVER_STREAMS,
+               "every handed over stream may need priming");
+
+struct handover_inst {
+    char uart_dev[PROPERTY_VALUE_MAX];
+    char uart_profile[16];
+    /* index into the SCM_RIGHTS fds, -1 for none */
+    int8_t fd[HANDOVER_FDS];
+    uint8_t recovery_requested;
+    uint8_t vendor_cmd;
+    int64_t cmd_sent_ms;
+    /* follow the message in this order, queued host ACL leads HANDOVER_BT */
+    uint32_t pending[HANDOVER_STREAMS];
+};
+
+struct handover_msg {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t num_instances;
+    struct handover_inst inst[MAX_FILTER_INSTANCES];
+};
+
+/* vendor.wc_transport.handover */
+static bool handover_enabled;
+/* Threads stop at their next packet boundary while set. Stays set once
+ * the handover went through, until this process is gone.
+ */
+static volatile bool handover_quiescing;
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int parked;
+    pthread_t thread;
+} handover = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/* A stage of the packet hook pipeline. A hook sees the BT packets of its
+ * direction and type before they are forwarded, only those with its opcode
+ * (command opcode or event code) unless that is -1. It returns HOOK_PASS to
+ * let the packet go on or HOOK_CONSUMED once it dropped or answered it.
+ * Hooks run in table order (pkt_hooks[]) on the thread forwarding the
+ * packet and are enabled by name in vendor.wc_transport.hooks.
+ */
+enum {
+    HOOK_PASS = 0,
+    HOOK_CONSUMED,
+};
+
+struct filter_instance;
+
+struct pkt_hook {
+    const char *name;
+    int direction;
+    unsigned char type;
+    int opcode;
+    int (*fn)(struct filter_instance *inst, int src_fd, unsigned char *buf, int len);
+    bool enabled;
+    /* what it cost so far */
+    uint64_t calls;
+    uint64_t consumed;
+    uint64_t ns;
+    uint64_t max_ns;
+};
+
+/* Everything tied to one UART. Instance 0 serves the historical device and
+ * bt_sock/ant_sock, instance n serves bt_sock<n>/ant_sock<n>. Each instance
+ * runs its own reader and client threads; the watchdog is shared.
+ */
+struct filter_instance {
+    int index;
+    char uart_dev[PROPERTY_VALUE_MAX];
+    char bt_sock[16];
+    char ant_sock[16];
+    /* CPU its threads are pinned to, -1 leaves it to the scheduler */
+    int cpu;
+
+    /* Serializes writes to the UART and both client sockets */
+    pthread_mutex_t signal_mutex;
+    int remote_bt_fd;
+    int remote_ant_fd;
+    int fd_transport;
+    /* while the client thread waits for a connection, else -1 */
+    int bt_listen_fd;
+    int ant_listen_fd;
+    /* bytes a parked thread read past its last packet */
+    unsigned char *ho_pending[HANDOVER_STREAMS];
+    int ho_pending_len[HANDOVER_STREAMS];
+    /* set once the client switched to shared memory, owned by its thread */
+    struct shm_endpoint *bt_shm;
+    struct shm_endpoint *ant_shm;
+    struct coalescer bt_coal;
+    struct coalescer ant_coal;
+    /* packets delivered in batches and the writes they took */
+    uint64_t coal_pkts;
+    uint64_t coal_writes;
+
+    struct acl_sched acl_sched;
+    struct diag_channel diag;
+
+    /* Library mode: BT goes to the stack instead of bt_sock. bt_cb is set
+     * for good on start, bt_cb_on follows wcnss_filter_start()/_stop()
+     */
+    struct wcnss_filter_callbacks bt_cb;
+    void *bt_cb_ctx;
+    bool bt_cb_on;
+    /* deliveries in progress */
+    int bt_cb_busy;
+
+    pthread_t bt_mon_thread;
+    pthread_t ant_mon_thread;
+    pthread_t reader_thread;
+    int reader_ret;
+    /* The reader gave up on the UART, nothing is written to it any more */
+    volatile bool uart_dead;
+    /* INST_THREAD_* running: set before a thread is created and cleared,
+     * under handover.lock, on its way out. Only these may be signalled.
+     */
+    unsigned int threads_live;
+
+    struct wdog_state wdog;
+    const struct uart_profile *uart_profile;
+    struct uart_profile_stats prof_stats;
+
+    struct rsp_cache_entry rsp_cache[RSP_CACHE_ENTRIES];
+    pthread_mutex_t rsp_cache_mutex;
+    unsigned int rsp_cache_hits;
+    unsigned int rsp_cache_misses;
+
+    /* forwarded traffic, indexed by HOST_TO_SOC/SOC_TO_HOST */
+    uint64_t pkts[2];
+    uint64_t bytes[2];
+    uint64_t last_bytes[2];
+};
+
+static struct filter_instance instances[MAX_FILTER_INSTANCES];
+static int num_instances;
+
+/* Running inside the BT stack's process, see wcnss_filter.h */
+static bool library_mode;
+/* depth of stack callbacks running on this thread */
+static __thread int in_bt_cb;
+
+/* vendor.wc_transport.* settings given on the command line (-p name=value).
+ * A filter started with them is a private one, wcnss_replay's: it takes
+ * nothing else from the system properties for those and sets none.
+ */
+#define MAX_PROP_OVERRIDES 32
+static struct {
+    const char *name;
+    const char *value;
+} prop_overrides[MAX_PROP_OVERRIDES];
+static int num_prop_overrides;
+
+static int filter_property_get(const char *key, char *value, const char *default_value)
+{
+    int i;
+
+    /* The last one given wins */
+    for (i = num_prop_overrides - 1; i >= 0; i--) {
+        if (!strncmp(key, "vendor.wc_transport.", 20) &&
+            !strcmp(key + 20, prop_overrides[i].name)) {
+            snprintf(value, PROPERTY_VALUE_MAX, "%s", prop_overrides[i].value);
+            return strlen(value);
+        }
+    }
+    return property_get(key, value, default_value);
+}
 
-static pthread_t bt_mon_thread;
-static pthread_t ant_mon_thread;
+static int filter_property_set(const char *key, const char *value)
+{
+    if (num_prop_overrides > 0)
+        return 0;
+    return property_set(key, value);
+}
 
-int copy_bt_data_to_channel(int src_fd, int dest_fd, unsigned char protocol_byte,int dir);
-int copy_ant_host_data_to_soc(int src_fd, int dest_fd, unsigned char protocol_byte);
+int copy_bt_data_to_channel(struct filter_instance *inst, int src_fd, int dest_fd,
+                            unsigned char protocol_byte,int dir);
+int copy_ant_host_data_to_soc(struct filter_instance *inst, int src_fd, int dest_fd,
+                              unsigned char protocol_byte);
+static int forward_bt_packet(struct filter_instance *inst, int src_fd, int dest_fd,
+                             unsigned char *buf, int len, int direction);
 
 static void handle_cleanup();
 static int do_write(int fd, unsigned char *buf, int len);
+static void acl_sched_drop(struct filter_instance *inst);
+
+static int64_t get_time_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t get_time_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t get_time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Signals the running threads of inst out of their blocking syscalls, with
+ * handover.lock held so none of them exits meanwhile
+ */
+static void kick_live_threads_locked(struct filter_instance *inst)
+{
+    if (inst->threads_live & INST_THREAD_READER)
+        pthread_kill(inst->reader_thread, wdog_signal);
+    if (inst->threads_live & INST_THREAD_BT)
+        pthread_kill(inst->bt_mon_thread, wdog_signal);
+    if (inst->threads_live & INST_THREAD_ANT)
+        pthread_kill(inst->ant_mon_thread, wdog_signal);
+    if (inst->threads_live & INST_THREAD_ACL)
+        pthread_kill(inst->acl_sched.thread, wdog_signal);
+}
+
+/* Kicks every thread that may be blocked on the UART out of its syscall
+ * with EINTR: the reader, and the threads writing to it. A write stuck on a
+ * controller holding CTS would keep signal_mutex from the recovery.
+ */
+static void wdog_kick_threads(struct filter_instance *inst)
+{
+    pthread_mutex_lock(&handover.lock);
+    kick_live_threads_locked(inst);
+    pthread_mutex_unlock(&handover.lock);
+}
+
+static void wdog_request_recovery(struct filter_instance *inst, const char *reason)
+{
+    /* Nothing left to recover once the reader is gone */
+    if (inst->wdog.recovery_requested || inst->uart_dead)
+        return;
+
+    ALOGE("%s: %s recovery requested: %s", __func__, inst->uart_dev, reason);
+    inst->wdog.recovery_requested = 1;
+    wdog_kick_threads(inst);
+}
+
+/* With signal_mutex held, whether host data may go to the UART. Nothing
+ * goes out while a recovery is pending: a kicked writer would only take
+ * the mutex again and block on the wedged UART before the recovery got its
+ * turn. Nor once the reader is gone and fd_transport no longer is the UART.
+ */
+static bool uart_writable(struct filter_instance *inst)
+{
+    if (inst->wdog.recovery_requested || inst->uart_dead) {
+        errno = EIO;
+        return false;
+    }
+    return true;
+}
+
+/* Host packet to the UART, with signal_mutex held */
+static int uart_write(struct filter_instance *inst, unsigned char *buf, int len)
+{
+    if (!uart_writable(inst))
+        return -1;
+    return do_write(inst->fd_transport, buf, len);
+}
+
+/* Every thread of an instance starts here */
+static void instance_thread_init(struct filter_instance *inst)
+{
+    cpu_set_t cpus;
+    int ret;
+
+    io_set_write_lock(&inst->signal_mutex);
+    if (inst->cpu < 0)
+        return;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(inst->cpu, &cpus);
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (ret != 0)
+        ALOGW("%s: unable to pin to cpu %d: %s", __func__, inst->cpu, strerror(ret));
+}
+
+/* Every thread of an instance that returns goes through here first */
+static void instance_thread_exit(struct filter_instance *inst, unsigned int thread)
+{
+    pthread_mutex_lock(&handover.lock);
+    inst->threads_live &= ~thread;
+    /* A handover waiting for it to park has one thread less to wait for */
+    pthread_cond_broadcast(&handover.cond);
+    pthread_mutex_unlock(&handover.lock);
+}
+
+static void account_forwarded(struct filter_instance *inst, int direction, int len)
+{
+    __atomic_fetch_add(&inst->pkts[direction], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&inst->bytes[direction], len, __ATOMIC_RELAXED);
+}
+
+/* A signal broke a syscall in the middle of a packet to make the thread
+ * stop for a handover: finish the packet first
+ */
+static bool handover_interrupted(int ret)
+{
+    return ret < 0 && errno == EINTR && handover_quiescing;
+}
+
+/* Packet boundary of the thread reading fd for role (HANDOVER_*, -1 for
+ * none). While a handover is on, the thread parks here with what it read
+ * past the boundary in ho_pending. It only comes back if the handover was
+ * abandoned, to carry on where it stopped.
+ */
+static void handover_checkpoint(struct filter_instance *inst, int role, int fd)
+{
+    unsigned char *pending = NULL;
+    int len = 0;
+
+    if (!handover_quiescing)
+        return;
+
+    if (fd > 0 && (len = io_detach_read(fd, &pending)) < 0)
+        len = 0;
+
+    pthread_mutex_lock(&handover.lock);
+    if (role >= 0) {
+        inst->ho_pending[role] = pending;
+        inst->ho_pending_len[role] = len;
+    }
+    handover.parked++;
+    pthread_cond_broadcast(&handover.cond);
+    while (handover_quiescing)
+        pthread_cond_wait(&handover.cond, &handover.lock);
+    handover.parked--;
+    if (role >= 0) {
+        inst->ho_pending[role] = NULL;
+        inst->ho_pending_len[role] = 0;
+    }
+    pthread_mutex_unlock(&handover.lock);
+
+    if (len > 0 && io_prime_read(fd, pending, len) < 0) {
+        /* The stream lost its framing, start it over */
+        ALOGE("%s: %d bytes of fd %d lost", __func__, len, fd);
+        if (role == HANDOVER_UART)
+            wdog_request_recovery(inst, "bytes lost on resume");
+        else
+            shutdown(fd, SHUT_RDWR);
+    }
+    free(pending);
+}
+
+static bool bt_client_present(struct filter_instance *inst)
+{
+    return inst->remote_bt_fd != 0 || __atomic_load_n(&inst->bt_cb_on, __ATOMIC_ACQUIRE);
+}
+
+/* Library mode: hands a host bound BT packet, or the SSR notification when
+ * buf is NULL, to the stack. Called without signal_mutex held since the
+ * stack may well send from within the callback.
+ */
+static int bt_cb_deliver(struct filter_instance *inst, unsigned char *buf, int len)
+{
+    __atomic_fetch_add(&inst->bt_cb_busy, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&inst->bt_cb_on, __ATOMIC_SEQ_CST)) {
+        in_bt_cb++;
+        if (buf != NULL)
+            inst->bt_cb.bt_recv(inst->bt_cb_ctx, buf, len);
+        else if (inst->bt_cb.bt_ssr != NULL)
+            inst->bt_cb.bt_ssr(inst->bt_cb_ctx);
+        in_bt_cb--;
+    }
+    __atomic_fetch_sub(&inst->bt_cb_busy, 1, __ATOMIC_SEQ_CST);
+    return len;
+}
+
+/* io_rx_tap_fn, records what the UART and the clients delivered */
+static void record_rx(int fd, const unsigned char *buf, int len)
+{
+    struct filter_instance *inst;
+    int i;
+
+    for (i = 0; i < num_instances; i++) {
+        inst = &instances[i];
+        if (fd == inst->fd_transport)
+            hci_record(HCI_REC_UART_RX, i, HCI_REC_CHAN_UART, HCI_REC_SOC_TO_HOST, buf, len);
+        else if (fd == inst->remote_bt_fd)
+            hci_record(HCI_REC_HOST_RX, i, HCI_REC_CHAN_BT, HCI_REC_HOST_TO_SOC, buf, len);
+        else if (fd == inst->remote_ant_fd)
+            hci_record(HCI_REC_HOST_RX, i, HCI_REC_CHAN_ANT, HCI_REC_HOST_TO_SOC, buf, len);
+        else
+            continue;
+        return;
+    }
+}
+
+static struct shm_endpoint *client_shm(struct filter_instance *inst, int fd)
+{
+    if (fd <= 0)
+        return NULL;
+    if (fd == inst->remote_bt_fd)
+        return inst->bt_shm;
+    if (fd == inst->remote_ant_fd)
+        return inst->ant_shm;
+    return NULL;
+}
+
+static struct coalescer *client_coalescer(struct filter_instance *inst, int fd)
+{
+    /* Shared memory clients already skip doorbells while they are busy */
+    if (fd <= 0 || client_shm(inst, fd) != NULL)
+        return NULL;
+    if (fd == inst->remote_bt_fd && inst->bt_coal.budget_us > 0)
+        return &inst->bt_coal;
+    if (fd == inst->remote_ant_fd && inst->ant_coal.budget_us > 0)
+        return &inst->ant_coal;
+    return NULL;
+}
+
+/* With signal_mutex held */
+static int coalesce_flush(struct filter_instance *inst, int fd, struct coalescer *co)
+{
+    int ret;
+
+    if (co == NULL || co->npkts == 0)
+        return 0;
+
+    ret = io_writev(fd, co->iov, co->npkts);
+    if (ret < 0)
+        ALOGE("%s: writev to fd %d failed: %s", __func__, fd, strerror(errno));
+    inst->coal_pkts += co->npkts;
+    inst->coal_writes++;
+    co->npkts = 0;
+    co->len = 0;
+    co->first_us = 0;
+    return ret;
+}
+
+/* Anything the stack is blocked on, or that must not be reordered behind
+ * a held packet, goes out right away
+ */
+static bool deliver_now(struct filter_instance *inst, int fd, unsigned char *buf, int len)
+{
+    if ((size_t)len > coalesce_bytes / 2)
+        return true;
+    if (fd != inst->remote_bt_fd || buf[0] != BT_EVT_PACKET_TYPE || len < 2)
+        return false;
+    return buf[1] == BT_EVT_CMD_CMPL || buf[1] == BT_EVT_CMD_STATUS ||
+           buf[1] == BT_EVT_HW_ERROR;
+}
+
+static int client_send(struct filter_instance *inst, int fd, unsigned char *buf, int len)
+{
+    struct shm_endpoint *shm = client_shm(inst, fd);
+
+    if (shm != NULL)
+        return shm_ring_send(shm, fd, buf, len);
+    return do_write(fd, buf, len);
+}
+
+/* Host bound packet, with signal_mutex held */
+static int client_write(struct filter_instance *inst, int fd, unsigned char *buf, int len)
+{
+    struct coalescer *co = client_coalescer(inst, fd);
+
+    if (co == NULL)
+        return client_send(inst, fd, buf, len);
 
-unsigned char reset_cmpl[] = {0x04, 0x0e, 0x04, 0x01,0x03, 0x0c, 0x00};
+    if (deliver_now(inst, fd, buf, len)) {
+        coalesce_flush(inst, fd, co);
+        return client_send(inst, fd, buf, len);
+    }
+
+    if (co->len + len > coalesce_bytes || co->npkts == COALESCE_MAX_PKTS)
+        coalesce_flush(inst, fd, co);
+    memcpy(co->buf + co->len, buf, len);
+    co->iov[co->npkts].iov_base = co->buf + co->len;
+    co->iov[co->npkts].iov_len = len;
+    co->npkts++;
+    co->len += len;
+    if (co->first_us == 0)
+        co->first_us = get_time_us();
+    if (co->len >= coalesce_bytes)
+        coalesce_flush(inst, fd, co);
+    return len;
+}
+
+/* Reader side: delivers whatever has used up its budget and returns how
+ * long until the next held packet is due, -1 if nothing is held
+ */
+static int coalesce_service(struct filter_instance *inst)
+{
+    struct coalescer *co[2] = { &inst->bt_coal, &inst->ant_coal };
+    int fds[2], i, left, next = -1;
+    int64_t now;
+
+    if (inst->bt_coal.budget_us == 0 && inst->ant_coal.budget_us == 0)
+        return -1;
+
+    pthread_mutex_lock(&inst->signal_mutex);
+    fds[0] = inst->remote_bt_fd;
+    fds[1] = inst->remote_ant_fd;
+    now = get_time_us();
+    for (i = 0; i < 2; i++) {
+        if (co[i]->npkts == 0)
+            continue;
+        left = co[i]->budget_us - (now - co[i]->first_us);
+        if (left <= 0)
+            coalesce_flush(inst, fds[i], co[i]);
+        else if (next < 0 || left < next)
+            next = left;
+    }
+    pthread_mutex_unlock(&inst->signal_mutex);
+    return next;
+}
 
 static int extract_uid(int uuid)
 {
@@ -139,41 +1000,57 @@ static int extract_uid(int uuid)
     return appid;
 }
 
-static int establish_remote_socket(char *name)
+/* Waits for the client of name. The listening socket stays in *listen_fd
+ * while waiting so a handover can pass it on, and one handed over is used
+ * instead of binding anew. A signal ends the wait with -1 and errno EINTR,
+ * the listening socket is kept for the next call then.
+ */
+static int establish_remote_socket(char *name, int *listen_fd)
 {
     int fd = -1;
     struct sockaddr_un client_address;
+    struct pollfd pfd;
     socklen_t clen;
     int sock_id, ret;
     struct ucred creds;
     int c_uid;
     ALOGV("%s(%s) Entry  ", __func__, name);
 
-    sock_id = socket(AF_LOCAL, SOCK_STREAM, 0);
+    sock_id = *listen_fd;
     if (sock_id < 0) {
-        ALOGE("%s: server Socket creation failure", __func__);
-        return fd;
-    }
+        sock_id = socket(AF_LOCAL, SOCK_STREAM, 0);
+        if (sock_id < 0) {
+            ALOGE("%s: server Socket creation failure", __func__);
+            return fd;
+        }
 
-    ALOGV("convert name to android abstract name:%s %d", name, sock_id);
-    if (socket_local_server_bind(sock_id,
-        name, ANDROID_SOCKET_NAMESPACE_ABSTRACT) >= 0) {
-        if (listen(sock_id, 5) == 0) {
-            ALOGV("listen to local socket:%s, fd:%d", name, sock_id);
+        ALOGV("convert name to android abstract name:%s %d", name, sock_id);
+        if (socket_local_server_bind(sock_id,
+            name, ANDROID_SOCKET_NAMESPACE_ABSTRACT) >= 0) {
+            if (listen(sock_id, 5) == 0) {
+                ALOGV("listen to local socket:%s, fd:%d", name, sock_id);
+            } else {
+                ALOGE("listen to local socket:failed");
+                close(sock_id);
+                return fd;
+            }
         } else {
-            ALOGE("listen to local socket:failed");
             close(sock_id);
+            ALOGE("%s: server bind failed for socket : %s", __func__, name);
             return fd;
         }
-    } else {
-        close(sock_id);
-        ALOGE("%s: server bind failed for socket : %s", __func__, name);
-        return fd;
+        *listen_fd = sock_id;
     }
 
+    pfd.fd = sock_id;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, -1) < 0)
+        return -1;
+
     clen = sizeof(client_address);
     ALOGV("%s: before accept_server_socket", name);
     fd = accept(sock_id, (struct sockaddr *)&client_address, &clen);
+    *listen_fd = -1;
     if (fd > 0) {
         ALOGV("%s accepted fd:%d for server fd:%d", name, fd, sock_id);
         close(sock_id);
@@ -209,156 +1086,610 @@ static int establish_remote_socket(char *name)
     return fd;
 }
 
-#ifdef DEBUG_MIMIC_CMD_TOUT
-/* This mimics the CMD TOUT by dropping the
- * "set Local name" command at filter
- * user can repro the cmd tout by setting the name
- * couple of times from UI
+/* Answers a command from the host on host_fd (or the stack's callback) with
+ * evt, in place of the controller
  */
-int command_is_change_lname(unsigned char* buf, int len) {
-    int val =1, i;
-    unsigned char lname[] = {0x01, 0x13, 0x0c};
-    ALOGE("%s:", __func__);
-    for (i=0; i<3; i++) {
-       if(buf[i] != lname[i]) val = 0;
+static int answer_host(struct filter_instance *inst, int host_fd, unsigned char *evt, int len)
+{
+    int retval;
+
+    if (inst->bt_cb.bt_recv != NULL)
+        return bt_cb_deliver(inst, evt, len);
+
+    pthread_mutex_lock(&inst->signal_mutex);
+    retval = client_write(inst, host_fd, evt, len);
+    pthread_mutex_unlock(&inst->signal_mutex);
+    return retval;
+}
+
+static struct rsp_cache_entry *rsp_cache_find(struct filter_instance *inst, unsigned short opcode)
+{
+    unsigned int i;
+
+    for (i = 0; i < RSP_CACHE_ENTRIES; i++) {
+        if (inst->rsp_cache[i].opcode == opcode)
+            return &inst->rsp_cache[i];
     }
-    return val;
+    return NULL;
 }
-#endif //DEBUG_MIMIC_CMD_TOUT
 
-#ifdef IGNORE_HCI_RESET
-/**
-  * this is to ignore HCI_RESET coming from stack.
-  * as performing HCI_RESET when ANT is on is not recomended.
-  * HCI_RESET only executed once from libbt-vendor as part of
-  * chip and NVM initialization
-  */
-int command_is_reset(unsigned char* buf, int len) {
-    int val = 1, i;
-    unsigned char reset[] = {0x01, 0x03, 0x0c, 0x00};
-    ALOGE("%s:", __func__);
-    for (i=0; i<len; i++) {
-       if(buf[i] != reset[i]) val = 0;
+static void rsp_cache_invalidate(struct filter_instance *inst, const char *reason)
+{
+    unsigned int i;
+    bool had_entries = false;
+
+    pthread_mutex_lock(&inst->rsp_cache_mutex);
+    for (i = 0; i < RSP_CACHE_ENTRIES; i++) {
+        had_entries |= inst->rsp_cache[i].valid || inst->rsp_cache[i].pending;
+        inst->rsp_cache[i].valid = false;
+        inst->rsp_cache[i].pending = false;
     }
-    return val;
+    pthread_mutex_unlock(&inst->rsp_cache_mutex);
+    /* Vendor init sends hundreds of commands, only log the first drop */
+    if (had_entries)
+        ALOGI("%s: %s response cache cleared: %s", __func__, inst->uart_dev, reason);
 }
-#endif//IGNORE_HCI_RESET
 
-int handle_command_writes(int fd) {
-    ALOGV("%s: ", __func__);
-    unsigned char first_byte;
-    int retval;
+/* Host command in buf (H4 framed). Returns the bytes written back to the
+ * host if it was answered from the cache, 0 if it has to go to the SoC.
+ */
+static int rsp_cache_handle_cmd(struct filter_instance *inst, int host_fd, unsigned char *buf, int len)
+{
+    struct rsp_cache_entry *entry;
+    unsigned char evt[sizeof(rsp_cache_template[0].evt)];
+    unsigned short opcode;
+    int params_len, evt_len = 0, retval;
 
-    ALOGV("%s: BT/ANT--Host-To-SoC: Reading 1st byte to determine the "
-        "sub-system(BT/ANT) and HCI PKT type(CMD/DATA)", __func__);
+    if (len < BT_CMD_HDR_SIZE + 1)
+        return 0;
+    opcode = buf[BT_CMD_OPCODE_OFFSET] | (buf[BT_CMD_OPCODE_OFFSET+1] << 8);
+    params_len = len - BT_CMD_HDR_SIZE - 1;
 
-    retval = read (fd, &first_byte, 1);
-    if (retval < 0) {
-        ALOGE("%s:read returns err: %d\n", __func__,retval);
-        return -1;
+    if (opcode == HCI_RESET) {
+        /* The controller forgets everything, so do we */
+        rsp_cache_invalidate(inst, "HCI_Reset");
+        return 0;
     }
 
-    if (retval == 0) {
-        ALOGE("%s: This indicates the close of other end", __func__);
-        return -99;
+    if ((buf[BT_CMD_OPCODE_OFFSET + 1] >> 2) == HCI_OGF_VENDOR) {
+        /* May rewrite what we cached, e.g. NVM tags or the BD address */
+        rsp_cache_invalidate(inst, "vendor command");
+        return 0;
     }
 
-    ALOGV("%s: Protocol_byte: %x", __func__, first_byte);
-    switch(first_byte) {
-        case ANT_CTL_PACKET_TYPE:
-        case ANT_DATA_PACKET_TYPE:
-            ALOGV("%s: Ant data", __func__);
-            retval = copy_ant_host_data_to_soc(fd, fd_transport, first_byte);
-            break;
-        case BT_EVT_PACKET_TYPE:
-        case BT_ACL_PACKET_TYPE:
-        case BT_CMD_PACKET_TYPE:
-            ALOGV("%s: BT data", __func__);
-            retval = copy_bt_data_to_channel(fd, fd_transport, first_byte, HOST_TO_SOC);
-            break;
-        case BT_SSR_TRIGGERED:
-            ALOGV("It is SSR triggered from command tout");
-            break;
-        default:
-            ALOGE("%s: Unexpected data format!!",__func__);
-            retval = -1;
+    entry = rsp_cache_find(inst, opcode);
+    if (entry == NULL || !rsp_cache_enabled)
+        return 0;
+
+    pthread_mutex_lock(&inst->rsp_cache_mutex);
+    if (entry->valid && entry->params_len == params_len &&
+        !memcmp(entry->params, buf + BT_CMD_HDR_SIZE + 1, params_len)) {
+        evt_len = entry->evt_len;
+        memcpy(evt, entry->evt, evt_len);
+    } else if (params_len <= RSP_CACHE_MAX_PARAMS) {
+        /* Catch the answer to this one */
+        entry->valid = false;
+        entry->pending = true;
+        entry->params_len = params_len;
+        memcpy(entry->params, buf + BT_CMD_HDR_SIZE + 1, params_len);
     }
+    pthread_mutex_unlock(&inst->rsp_cache_mutex);
 
-    ALOGV("%s: retval %d", __func__, 0);
-    return 0;
+    if (evt_len == 0) {
+        inst->rsp_cache_misses++;
+        return 0;
+    }
+
+    ALOGV("%s: answering opcode 0x%04x from cache", __func__, opcode);
+    inst->rsp_cache_hits++;
+    retval = answer_host(inst, host_fd, evt, evt_len);
+    if (retval < 0)
+        ALOGE("%s: error while writing cached response: %s", __func__, strerror(errno));
+    return retval;
 }
 
-static int bt_thread() {
-    fd_set client_fds;
-    int retval, n;
+/* Controller event in buf (H4 framed) */
+static void rsp_cache_capture(struct filter_instance *inst, unsigned char *buf, int len)
+{
+    struct rsp_cache_entry *entry;
+    unsigned short opcode;
+
+    if (len <= BT_EVT_CC_STATUS_OFFSET || buf[1] != BT_EVT_CMD_CMPL)
+        return;
+    opcode = buf[BT_EVT_CC_OPCODE_OFFSET] | (buf[BT_EVT_CC_OPCODE_OFFSET+1] << 8);
+
+    entry = rsp_cache_find(inst, opcode);
+    if (entry == NULL)
+        return;
+
+    pthread_mutex_lock(&inst->rsp_cache_mutex);
+    if (entry->pending && buf[BT_EVT_CC_STATUS_OFFSET] == 0 &&
+        len <= (int)sizeof(entry->evt)) {
+        memcpy(entry->evt, buf, len);
+        entry->evt_len = len;
+        entry->valid = true;
+        ALOGV("%s: cached response for opcode 0x%04x", __func__, opcode);
+    }
+    entry->pending = false;
+    pthread_mutex_unlock(&inst->rsp_cache_mutex);
+}
 
-    ALOGV("%s: Entry ", __func__);
-    do {
-        remote_bt_fd = establish_remote_socket(BT_SOCK);
+/* Debug only: drops HCI_Write_Local_Name so the stack runs into its command
+ * timeout. Renaming the device a couple of times from the UI repros it.
+ */
+static int hook_mimic_cmd_tout(struct filter_instance *inst, int src_fd,
+                               unsigned char *buf, int len)
+{
+    (void)inst;
+    (void)src_fd;
+    (void)buf;
+    (void)len;
+    ALOGE("Drop the change local name cmd");
+    return HOOK_CONSUMED;
+}
 
-        if (remote_bt_fd < 0) {
-            ALOGE("%s: invalid remote socket", __func__);
-            return -1;
-        }
+/* HCI_Reset is done once, by libbt-vendor while it initializes the chip and
+ * NVM. One from the stack is answered here, resetting with ANT on is not
+ * recommended.
+ */
+static int hook_ignore_reset(struct filter_instance *inst, int src_fd,
+                             unsigned char *buf, int len)
+{
+    unsigned char evt[] = { BT_EVT_PACKET_TYPE, BT_EVT_CMD_CMPL, 0x04, 0x01,
+                            HCI_RESET & 0xff, HCI_RESET >> 8, 0x00 };
+
+    (void)buf;
+    (void)len;
+    if (answer_host(inst, src_fd, evt, sizeof(evt)) < 0)
+        ALOGE("%s: unable to answer HCI_Reset: %s", __func__, strerror(errno));
+    return HOOK_CONSUMED;
+}
 
-        FD_ZERO(&client_fds);
-        FD_SET(remote_bt_fd, &client_fds);
+static struct pkt_hook pkt_hooks[] = {
+    { .name = "ignore_reset", .direction = HOST_TO_SOC, .type = BT_CMD_PACKET_TYPE,
+      .opcode = HCI_RESET, .fn = hook_ignore_reset },
+    { .name = "mimic_cmd_tout", .direction = HOST_TO_SOC, .type = BT_CMD_PACKET_TYPE,
+      .opcode = HCI_WRITE_LOCAL_NAME, .fn = hook_mimic_cmd_tout },
+};
 
-        do {
-            ALOGV("%s: Back in BT select loop", __func__);
-            n = select(remote_bt_fd+1, &client_fds, NULL, NULL, NULL);
-            if(n < 0){
-                ALOGE("Select: failed: %s", strerror(errno));
-                break;
-            }
-            ALOGV("%s: select came out\n", __func__);
-            if (FD_ISSET(remote_bt_fd, &client_fds)) {
-                retval = handle_command_writes(remote_bt_fd);
-                ALOGV("%s: handle_command_writes . %d", __func__, retval);
-                if(retval < 0) {
-                    if (retval == -99) {
-                        ALOGV("%s:End of wait loop", __func__);
-                    }
-                    ALOGV("%s: handle_command_writes returns: %d: ", __func__, retval);
-                    break;
-                }
-            }
-        } while(1);
+#define NUM_PKT_HOOKS (sizeof(pkt_hooks)/sizeof(pkt_hooks[0]))
 
-        ALOGI("%s: Bluetooth turned off", __func__);
-        close(remote_bt_fd);
-        remote_bt_fd = 0;
-        handle_cleanup();
-    } while(1);
+/* What the enabled hooks want, by direction: a bit per packet type, and per
+ * type a bit per low byte of the opcode. Everything else skips the pipeline
+ * after one or two loads.
+ */
+static uint32_t hook_types[2];
+static uint32_t hook_keys[2][BT_EVT_PACKET_TYPE + 1][256 / 32];
+static char hooks_value[PROPERTY_VALUE_MAX];
 
-    pthread_exit(NULL);
-    return 0;
+/* Command opcode or event code of buf, -1 for packets without one */
+static int pkt_hook_key(unsigned char *buf, int len)
+{
+    if (buf[0] == BT_CMD_PACKET_TYPE && len >= 1 + BT_CMD_HDR_SIZE)
+        return buf[BT_CMD_OPCODE_OFFSET] | buf[BT_CMD_OPCODE_OFFSET + 1] << 8;
+    if (buf[0] == BT_EVT_PACKET_TYPE && len >= 1 + BT_EVT_HDR_SIZE)
+        return buf[1];
+    return -1;
 }
 
-static int ant_thread() {
-    fd_set client_fds;
-    int retval, n;
+static bool pkt_hooks_want(int direction, unsigned char type)
+{
+    return type <= BT_EVT_PACKET_TYPE &&
+           (__atomic_load_n(&hook_types[direction], __ATOMIC_RELAXED) & (1U << type));
+}
 
-    ALOGV("%s: Entry ", __func__);
-    do {
-        remote_ant_fd = establish_remote_socket(ANT_SOCK);
-        if (remote_ant_fd < 0) {
-            ALOGE("%s: invalid remote socket", __func__);
-            return -1;
+/* Runs the enabled hooks on the packet in buf, in table order. Returns
+ * HOOK_CONSUMED once one of them took care of the packet.
+ */
+static int run_pkt_hooks(struct filter_instance *inst, int src_fd, unsigned char *buf,
+                         int len, int direction)
+{
+    struct pkt_hook *hook;
+    unsigned char type = buf[0];
+    uint64_t start, ns;
+    unsigned int i;
+    int key, ret;
+
+    if (!pkt_hooks_want(direction, type))
+        return HOOK_PASS;
+    key = pkt_hook_key(buf, len);
+    if (key >= 0 && !(__atomic_load_n(&hook_keys[direction][type][(key & 0xff) / 32],
+                                      __ATOMIC_RELAXED) & (1U << (key % 32))))
+        return HOOK_PASS;
+
+    for (i = 0; i < NUM_PKT_HOOKS; i++) {
+        hook = &pkt_hooks[i];
+        if (!__atomic_load_n(&hook->enabled, __ATOMIC_RELAXED) ||
+            hook->direction != direction || hook->type != type ||
+            (hook->opcode >= 0 && hook->opcode != key))
+            continue;
+
+        start = get_time_ns();
+        ret = hook->fn(inst, src_fd, buf, len);
+        ns = get_time_ns() - start;
+        __atomic_fetch_add(&hook->calls, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&hook->ns, ns, __ATOMIC_RELAXED);
+        if (ns > __atomic_load_n(&hook->max_ns, __ATOMIC_RELAXED))
+            __atomic_store_n(&hook->max_ns, ns, __ATOMIC_RELAXED);
+        if (ret == HOOK_CONSUMED) {
+            __atomic_fetch_add(&hook->consumed, 1, __ATOMIC_RELAXED);
+            return HOOK_CONSUMED;
         }
+    }
+    return HOOK_PASS;
+}
 
-        FD_ZERO(&client_fds);
-        FD_SET(remote_ant_fd, &client_fds);
-        do {
-            ALOGV("%s: Back in ANT select loop", __func__);
-            n = select(remote_ant_fd+1, &client_fds, &client_fds, NULL, NULL);
-            if(n < 0){
-                ALOGE("Select: failed: %s", strerror(errno));
-                break;
-            }
-            ALOGV("%s: Step 2-ANT-HTS: ANT CMD/DATA available for processing...\n", __func__);
-            if (FD_ISSET(remote_ant_fd, &client_fds)) {
-                retval = handle_command_writes(remote_ant_fd);
+static bool hook_listed(const char *list, const char *name)
+{
+    char value[PROPERTY_VALUE_MAX];
+    char *entry, *saveptr = NULL;
+
+    snprintf(value, sizeof(value), "%s", list);
+    for (entry = strtok_r(value, ", ", &saveptr); entry != NULL;
+         entry = strtok_r(NULL, ", ", &saveptr)) {
+        if (!strcmp(entry, name))
+            return true;
+    }
+    return false;
+}
+
+/* vendor.wc_transport.hooks: names of the hooks to run. Re-checked by the
+ * watchdog so hooks can be switched while running.
+ */
+static void check_pkt_hooks()
+{
+    char value[PROPERTY_VALUE_MAX] = {'\0'};
+    uint32_t types[2] = { 0, 0 };
+    uint32_t keys[2][BT_EVT_PACKET_TYPE + 1][256 / 32];
+    struct pkt_hook *hook;
+    unsigned int i, j;
+    int dir, type;
+    bool on;
+
+    filter_property_get("vendor.wc_transport.hooks", value, "");
+    if (!strcmp(value, hooks_value))
+        return;
+    snprintf(hooks_value, sizeof(hooks_value), "%s", value);
+
+    memset(keys, 0, sizeof(keys));
+    for (i = 0; i < NUM_PKT_HOOKS; i++) {
+        hook = &pkt_hooks[i];
+        on = hook_listed(value, hook->name);
+        if (on != hook->enabled)
+            ALOGI("%s: %s hook %s", __func__, hook->name, on ? "enabled" : "disabled");
+        __atomic_store_n(&hook->enabled, on, __ATOMIC_RELAXED);
+        if (!on)
+            continue;
+
+        types[hook->direction] |= 1U << hook->type;
+        for (j = 0; j < 256 / 32; j++) {
+            if (hook->opcode < 0)
+                keys[hook->direction][hook->type][j] = ~0U;
+            else if ((unsigned int)(hook->opcode & 0xff) / 32 == j)
+                keys[hook->direction][hook->type][j] |= 1U << (hook->opcode % 32);
+        }
+    }
+
+    /* Keys first, a type is only looked at once its keys are in place */
+    for (dir = HOST_TO_SOC; dir <= SOC_TO_HOST; dir++) {
+        for (type = 0; type <= BT_EVT_PACKET_TYPE; type++) {
+            for (j = 0; j < 256 / 32; j++)
+                __atomic_store_n(&hook_keys[dir][type][j], keys[dir][type][j],
+                                 __ATOMIC_RELAXED);
+        }
+    }
+    for (dir = HOST_TO_SOC; dir <= SOC_TO_HOST; dir++)
+        __atomic_store_n(&hook_types[dir], types[dir], __ATOMIC_RELEASE);
+}
+
+static void dump_hook_stats()
+{
+    struct pkt_hook *hook;
+    uint64_t calls;
+    unsigned int i;
+
+    for (i = 0; i < NUM_PKT_HOOKS; i++) {
+        hook = &pkt_hooks[i];
+        calls = __atomic_load_n(&hook->calls, __ATOMIC_RELAXED);
+        if (!hook->enabled && calls == 0)
+            continue;
+        ALOGI("stats(hook %s): %s, %llu calls, %llu consumed, avg %llu ns, max %llu ns",
+              hook->name, hook->enabled ? "on" : "off", (unsigned long long)calls,
+              (unsigned long long)__atomic_load_n(&hook->consumed, __ATOMIC_RELAXED),
+              (unsigned long long)(calls ? __atomic_load_n(&hook->ns, __ATOMIC_RELAXED) /
+                                           calls : 0),
+              (unsigned long long)__atomic_load_n(&hook->max_ns, __ATOMIC_RELAXED));
+    }
+}
+
+/* Client asked to move its data path to shared memory. The answer goes out
+ * under signal_mutex so no host bound packet can slip in between it and
+ * the switch over.
+ */
+static void attach_client_shm(struct filter_instance *inst, int fd)
+{
+    struct shm_endpoint *shm = NULL;
+    struct shm_endpoint **slot;
+
+    slot = fd == inst->remote_bt_fd ? &inst->bt_shm : &inst->ant_shm;
+    if (!shm_ring_enabled)
+        ALOGI("%s: shared memory rings disabled", __func__);
+    else if (io_backend_get_type() != IO_BACKEND_SELECT)
+        /* io_uring keeps the socket read armed, it cannot share the wait */
+        ALOGI("%s: shared memory rings need the select io backend", __func__);
+    else if (*slot != NULL)
+        ALOGE("%s: fd %d already on shared memory", __func__, fd);
+    else
+        shm = shm_ring_create(SHM_RING_SIZE);
+
+    pthread_mutex_lock(&inst->signal_mutex);
+    coalesce_flush(inst, fd, fd == inst->remote_bt_fd ? &inst->bt_coal : &inst->ant_coal);
+    if (shm_ring_offer(shm, fd, SHM_RING_REQUEST) < 0) {
+        ALOGE("%s: unable to answer fd %d: %s", __func__, fd, strerror(errno));
+        shm_ring_destroy(shm);
+        shm = NULL;
+    } else if (shm != NULL) {
+        *slot = shm;
+    }
+    pthread_mutex_unlock(&inst->signal_mutex);
+
+    ALOGI("%s: %s client on fd %d uses %s", __func__, inst->uart_dev, fd,
+          shm != NULL ? "shared memory" : "the socket");
+}
+
+/* Client on fd went away, drop what was set up for it */
+static void release_client(struct filter_instance *inst, int fd)
+{
+    struct shm_endpoint **slot;
+    struct shm_endpoint *shm;
+    struct coalescer *co;
+
+    slot = fd == inst->remote_bt_fd ? &inst->bt_shm : &inst->ant_shm;
+    co = fd == inst->remote_bt_fd ? &inst->bt_coal : &inst->ant_coal;
+    pthread_mutex_lock(&inst->signal_mutex);
+    shm = *slot;
+    *slot = NULL;
+    co->npkts = 0;
+    co->len = 0;
+    co->first_us = 0;
+    pthread_mutex_unlock(&inst->signal_mutex);
+    shm_ring_destroy(shm);
+}
+
+/* Expected length of the H4 packet starting in buf, -1 if it cannot be one */
+static int host_packet_len(unsigned char *buf, int len)
+{
+    switch (buf[0]) {
+        case BT_ACL_PACKET_TYPE:
+            if (len < 1 + BT_ACL_HDR_SIZE)
+                return -1;
+            return 1 + BT_ACL_HDR_SIZE + (buf[1 + BT_ACL_HDR_LEN_OFFSET] |
+                                          buf[2 + BT_ACL_HDR_LEN_OFFSET] << 8);
+        case BT_SCO_PACKET_TYPE:
+        case BT_CMD_PACKET_TYPE:
+            if (len < 1 + BT_CMD_HDR_SIZE)
+                return -1;
+            return 1 + BT_CMD_HDR_SIZE + buf[1 + BT_CMD_HDR_LEN_OFFSET];
+        case BT_EVT_PACKET_TYPE:
+            if (len < 1 + BT_EVT_HDR_SIZE)
+                return -1;
+            return 1 + BT_EVT_HDR_SIZE + buf[1 + BT_EVT_HDR_LEN_OFFSET];
+        case ANT_CTL_PACKET_TYPE:
+        case ANT_DATA_PACKET_TYPE:
+            if (len < ANT_CMD_HDR_SIZE)
+                return -1;
+            return ANT_CMD_HDR_SIZE + buf[ANT_HDR_OFFSET_LEN];
+        default:
+            return -1;
+    }
+}
+
+/* Forwards everything the client queued on its ring to the SoC */
+static int drain_client_shm(struct filter_instance *inst, int fd, struct shm_endpoint *shm)
+{
+    int len, retval;
+
+    if (shm_pkt == NULL) {
+        shm_pkt = malloc(SHM_MAX_PKT);
+        if (shm_pkt == NULL) {
+            ALOGE("%s:alloc error", __func__);
+            return -2;
+        }
+    }
+
+    while ((len = shm_ring_recv(shm, shm_pkt, SHM_MAX_PKT)) != 0) {
+        if (len < 0) {
+            ALOGE("%s: bad ring contents from fd %d: %s", __func__, fd, strerror(errno));
+            if (errno == EMSGSIZE)
+                continue;
+            return -1;
+        }
+        hci_record(HCI_REC_HOST_RX, inst->index, fd == inst->remote_ant_fd ?
+                   HCI_REC_CHAN_ANT : HCI_REC_CHAN_BT, HCI_REC_HOST_TO_SOC, shm_pkt, len);
+        /* A malformed packet would throw the UART framing off for good */
+        if (host_packet_len(shm_pkt, len) != len) {
+            ALOGE("%s: dropping malformed packet (type %x, %d bytes)", __func__,
+                  shm_pkt[0], len);
+            continue;
+        }
+
+        if (shm_pkt[0] == ANT_CTL_PACKET_TYPE || shm_pkt[0] == ANT_DATA_PACKET_TYPE) {
+            hci_record(HCI_REC_PACKET, inst->index, HCI_REC_CHAN_ANT, HCI_REC_HOST_TO_SOC,
+                       shm_pkt, len);
+            pthread_mutex_lock(&inst->signal_mutex);
+            retval = uart_write(inst, shm_pkt, len);
+            pthread_mutex_unlock(&inst->signal_mutex);
+            if (retval > 0)
+                account_forwarded(inst, HOST_TO_SOC, retval);
+        } else {
+            retval = forward_bt_packet(inst, fd, inst->fd_transport, shm_pkt, len,
+                                       HOST_TO_SOC);
+        }
+        if (retval < 0)
+            ALOGE("%s: write to SoC failed: %s", __func__, strerror(errno));
+    }
+    return 0;
+}
+
+/* Waits for the client on fd. Packets it queued on shared memory are
+ * forwarded from here; returns > 0 once the socket itself is readable.
+ */
+static int wait_client(struct filter_instance *inst, int fd)
+{
+    struct shm_endpoint *shm = client_shm(inst, fd);
+    int ret;
+
+    if (shm == NULL)
+        return io_wait_readable(fd);
+
+    do {
+        ret = shm_ring_wait(shm, fd);
+        if (ret < 0)
+            return -1;
+        if ((ret & SHM_RING_READY) && drain_client_shm(inst, fd, shm) < 0)
+            return -1;
+    } while (!(ret & SHM_RING_CTRL));
+    return 1;
+}
+
+int handle_command_writes(struct filter_instance *inst, int fd) {
+    ALOGV("%s: ", __func__);
+    unsigned char first_byte;
+    int retval;
+
+    ALOGV("%s: BT/ANT--Host-To-SoC: Reading 1st byte to determine the "
+        "sub-system(BT/ANT) and HCI PKT type(CMD/DATA)", __func__);
+
+    retval = io_read(fd, &first_byte, 1);
+    if (retval < 0) {
+        ALOGE("%s:read returns err: %d\n", __func__,retval);
+        return -1;
+    }
+
+    if (retval == 0) {
+        ALOGE("%s: This indicates the close of other end", __func__);
+        return -99;
+    }
+
+    ALOGV("%s: Protocol_byte: %x", __func__, first_byte);
+    switch(first_byte) {
+        case ANT_CTL_PACKET_TYPE:
+        case ANT_DATA_PACKET_TYPE:
+            ALOGV("%s: Ant data", __func__);
+            retval = copy_ant_host_data_to_soc(inst, fd, inst->fd_transport, first_byte);
+            break;
+        case BT_EVT_PACKET_TYPE:
+        case BT_ACL_PACKET_TYPE:
+        case BT_CMD_PACKET_TYPE:
+            ALOGV("%s: BT data", __func__);
+            retval = copy_bt_data_to_channel(inst, fd, inst->fd_transport, first_byte, HOST_TO_SOC);
+            break;
+        case BT_SSR_TRIGGERED:
+            ALOGV("It is SSR triggered from command tout");
+            wdog_request_recovery(inst, "SSR triggered by host");
+            break;
+        case SHM_RING_REQUEST:
+            attach_client_shm(inst, fd);
+            break;
+        default:
+            ALOGE("%s: Unexpected data format!!",__func__);
+            retval = -1;
+    }
+
+    ALOGV("%s: retval %d", __func__, 0);
+    return 0;
+}
+
+static int bt_thread(struct filter_instance *inst) {
+    int retval, n, fd;
+
+    ALOGV("%s: Entry ", __func__);
+    instance_thread_init(inst);
+    do {
+        /* A client handed over by the previous filter is served right away */
+        if (inst->remote_bt_fd == 0) {
+            fd = establish_remote_socket(inst->bt_sock, &inst->bt_listen_fd);
+            if (fd < 0 && errno == EINTR) {
+                handover_checkpoint(inst, -1, 0);
+                continue;
+            }
+            if (fd < 0) {
+                ALOGE("%s: invalid remote socket", __func__);
+                instance_thread_exit(inst, INST_THREAD_BT);
+                return -1;
+            }
+            inst->remote_bt_fd = fd;
+        }
+
+        do {
+            handover_checkpoint(inst, HANDOVER_BT, inst->remote_bt_fd);
+            ALOGV("%s: Back in BT select loop", __func__);
+            n = wait_client(inst, inst->remote_bt_fd);
+            if(n < 0){
+                if (errno == EINTR)
+                    continue;
+                ALOGE("Select: failed: %s", strerror(errno));
+                break;
+            }
+            ALOGV("%s: select came out\n", __func__);
+            if (n > 0) {
+                retval = handle_command_writes(inst, inst->remote_bt_fd);
+                ALOGV("%s: handle_command_writes . %d", __func__, retval);
+                if(retval < 0) {
+                    if (retval == -99) {
+                        ALOGV("%s:End of wait loop", __func__);
+                    }
+                    ALOGV("%s: handle_command_writes returns: %d: ", __func__, retval);
+                    break;
+                }
+            }
+        } while(1);
+
+        ALOGI("%s: Bluetooth turned off", __func__);
+        release_client(inst, inst->remote_bt_fd);
+        acl_sched_drop(inst);
+        io_close(inst->remote_bt_fd);
+        inst->remote_bt_fd = 0;
+        handle_cleanup();
+    } while(1);
+
+    pthread_exit(NULL);
+    return 0;
+}
+
+static int ant_thread(struct filter_instance *inst) {
+    int retval, n, fd;
+
+    ALOGV("%s: Entry ", __func__);
+    instance_thread_init(inst);
+    do {
+        if (inst->remote_ant_fd == 0) {
+            fd = establish_remote_socket(inst->ant_sock, &inst->ant_listen_fd);
+            if (fd < 0 && errno == EINTR) {
+                handover_checkpoint(inst, -1, 0);
+                continue;
+            }
+            if (fd < 0) {
+                ALOGE("%s: invalid remote socket", __func__);
+                instance_thread_exit(inst, INST_THREAD_ANT);
+                return -1;
+            }
+            inst->remote_ant_fd = fd;
+        }
+
+        do {
+            handover_checkpoint(inst, HANDOVER_ANT, inst->remote_ant_fd);
+            ALOGV("%s: Back in ANT select loop", __func__);
+            n = wait_client(inst, inst->remote_ant_fd);
+            if(n < 0){
+                if (errno == EINTR)
+                    continue;
+                ALOGE("Select: failed: %s", strerror(errno));
+                break;
+            }
+            ALOGV("%s: Step 2-ANT-HTS: ANT CMD/DATA available for processing...\n", __func__);
+            if (n > 0) {
+                retval = handle_command_writes(inst, inst->remote_ant_fd);
                 if(retval < 0) {
                    if (retval == -99) {
                        ALOGV("%s:End of wait loop", __func__);
@@ -371,8 +1702,9 @@ static int ant_thread() {
         } while(1);
 
         ALOGI("%s: ANT turned off", __func__);
-        close(remote_ant_fd);
-        remote_ant_fd = 0;
+        release_client(inst, inst->remote_ant_fd);
+        io_close(inst->remote_ant_fd);
+        inst->remote_ant_fd = 0;
         handle_cleanup();
     } while(1);
 
@@ -380,28 +1712,92 @@ static int ant_thread() {
     return 0;
 }
 
-static int init_transport() {
+static const struct uart_profile *find_uart_profile(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(uart_profiles)/sizeof(uart_profiles[0]); i++) {
+        if (!strcmp(uart_profiles[i].name, name))
+            return &uart_profiles[i];
+    }
+    return NULL;
+}
+
+static int apply_uart_profile(struct filter_instance *inst, int fd, const struct uart_profile *prof)
+{
+    struct termios term;
+    struct serial_struct serial;
+
+    if (tcgetattr(fd, &term) < 0) {
+        ALOGE("%s: tcgetattr failed: %s", __func__, strerror(errno));
+        return -1;
+    }
+    term.c_cc[VMIN] = prof->vmin;
+    term.c_cc[VTIME] = prof->vtime;
+    if (tcsetattr(fd, TCSANOW, &term) < 0) {
+        ALOGE("%s: tcsetattr failed: %s", __func__, strerror(errno));
+        return -1;
+    }
+
+    /* Not every UART driver implements it, the termios part still applies */
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+        if (prof->low_latency)
+            serial.flags |= ASYNC_LOW_LATENCY;
+        else
+            serial.flags &= ~ASYNC_LOW_LATENCY;
+        if (ioctl(fd, TIOCSSERIAL, &serial) < 0)
+            ALOGW("%s: TIOCSSERIAL failed: %s", __func__, strerror(errno));
+    } else if (prof->low_latency) {
+        ALOGW("%s: no low_latency support: %s", __func__, strerror(errno));
+    }
+
+    io_set_read_batch(fd, prof->read_batch);
+    inst->uart_profile = prof;
+    ALOGI("%s: %s: %s profile: vmin %d vtime %d low_latency %d batch %zu", __func__,
+          inst->uart_dev, prof->name, prof->vmin, prof->vtime, prof->low_latency, prof->read_batch);
+    return 0;
+}
+
+static void check_uart_profile(struct filter_instance *inst)
+{
+    char value[PROPERTY_VALUE_MAX] = {'\0'};
+    const struct uart_profile *prof;
+
+    filter_property_get(UART_PROFILE_PROP, value, "default");
+    if (!strcmp(value, inst->uart_profile->name))
+        return;
+
+    prof = find_uart_profile(value);
+    if (prof == NULL) {
+        ALOGE("%s: unknown uart profile %s", __func__, value);
+        return;
+    }
+    if (inst->fd_transport > 0)
+        apply_uart_profile(inst, inst->fd_transport, prof);
+}
+
+static int init_transport(struct filter_instance *inst) {
     struct termios   term;
     uint32_t baud = B3000000;
     uint8_t stop_bits = 0;
 
     ALOGV("%s: Entry ", __func__);
 
-    if ((fd_transport = open(BT_HS_UART_DEVICE, O_RDWR)) == -1) {
-        ALOGE("%s: Unable to open %s: %d (%s)", __func__, BT_HS_UART_DEVICE,
-           fd_transport, strerror(errno));
+    if ((inst->fd_transport = open(inst->uart_dev, O_RDWR)) == -1) {
+        ALOGE("%s: Unable to open %s: %d (%s)", __func__, inst->uart_dev,
+           inst->fd_transport, strerror(errno));
         return -1;
     }
 
-    if (tcflush(fd_transport, TCIOFLUSH) < 0) {
-        ALOGE("issue while tcflush %s", BT_HS_UART_DEVICE);
-        close(fd_transport);
+    if (tcflush(inst->fd_transport, TCIOFLUSH) < 0) {
+        ALOGE("issue while tcflush %s", inst->uart_dev);
+        close(inst->fd_transport);
         return -1;
     }
 
-    if (tcgetattr(fd_transport, &term) < 0) {
-        ALOGE("issue while tcgetattr %s", BT_HS_UART_DEVICE);
-        close(fd_transport);
+    if (tcgetattr(inst->fd_transport, &term) < 0) {
+        ALOGE("issue while tcgetattr %s", inst->uart_dev);
+        close(inst->fd_transport);
         return -1;
     }
 
@@ -409,36 +1805,41 @@ static int init_transport() {
     /* Set RTS/CTS HW Flow Control*/
     term.c_cflag |= (CRTSCTS | stop_bits);
 
-    if (tcsetattr(fd_transport, TCSANOW, &term) < 0) {
-       ALOGE("issue while tcsetattr %s", BT_HS_UART_DEVICE);
-       close(fd_transport);
+    if (tcsetattr(inst->fd_transport, TCSANOW, &term) < 0) {
+       ALOGE("issue while tcsetattr %s", inst->uart_dev);
+       close(inst->fd_transport);
        return -1;
     }
 
-    if (tcflush(fd_transport, TCIOFLUSH) < 0) {
-        ALOGE("after enabling flags issue while tcflush %s", BT_HS_UART_DEVICE);
-        close(fd_transport);
+    if (tcflush(inst->fd_transport, TCIOFLUSH) < 0) {
+        ALOGE("after enabling flags issue while tcflush %s", inst->uart_dev);
+        close(inst->fd_transport);
         return -1;
     }
 
-    if (tcsetattr(fd_transport, TCSANOW, &term) < 0) {
-       ALOGE("issue while tcsetattr %s", BT_HS_UART_DEVICE);
-       close(fd_transport);
+    if (tcsetattr(inst->fd_transport, TCSANOW, &term) < 0) {
+       ALOGE("issue while tcsetattr %s", inst->uart_dev);
+       close(inst->fd_transport);
        return -1;
     }
 
-    if (tcflush(fd_transport, TCIOFLUSH) < 0) {
-        ALOGE("after enabling flags issue while tcflush %s", BT_HS_UART_DEVICE);
-        close(fd_transport);
+    if (tcflush(inst->fd_transport, TCIOFLUSH) < 0) {
+        ALOGE("after enabling flags issue while tcflush %s", inst->uart_dev);
+        close(inst->fd_transport);
         return -1;
     }
 
     /* set input/output baudrate */
     cfsetospeed(&term, baud);
     cfsetispeed(&term, baud);
-    tcsetattr(fd_transport, TCSANOW, &term);
-    ALOGV("%s returns fd: %d", __func__, fd_transport);
-    return fd_transport;
+    tcsetattr(inst->fd_transport, TCSANOW, &term);
+
+    /* Re-initialization keeps whatever profile was active */
+    if (inst->uart_profile != &uart_profiles[0])
+        apply_uart_profile(inst, inst->fd_transport, inst->uart_profile);
+
+    ALOGV("%s returns fd: %d", __func__, inst->fd_transport);
+    return inst->fd_transport;
 }
 
 static int do_write(int fd, unsigned char *buf,int len)
@@ -447,7 +1848,9 @@ static int do_write(int fd, unsigned char *buf,int len)
     int write_offset = 0;
     int write_len = len;
     do {
-        ret = write(fd, buf+write_offset, write_len);
+        ret = io_write(fd, buf+write_offset, write_len);
+        if (handover_interrupted(ret))
+            continue;
         if (ret < 0)
         {
             ALOGE("%s: write failed ret = %d err = %s",__func__,ret,strerror(errno));
@@ -490,7 +1893,9 @@ int do_read(int fd, unsigned char* buf, size_t len) {
    read_offset = 0;
 
    do {
-       bytes_read = read(fd, buf+read_offset, bytes_left);
+       bytes_read = io_read(fd, buf+read_offset, bytes_left);
+       if (handover_interrupted(bytes_read))
+           continue;
        if (bytes_read < 0) {
            ALOGE("%s: Read error: %d (%s)", __func__, bytes_left, strerror(errno));
            return -1;
@@ -513,67 +1918,612 @@ int do_read(int fd, unsigned char* buf, size_t len) {
    return len;
 }
 
-int copy_bt_data_to_channel(int src_fd, int dest_fd, unsigned char protocol_byte,int direction) {
-    unsigned char len;
-    unsigned short acl_len;
-    unsigned char* buf;
-    unsigned char hdr[MAX_BT_HDR_SIZE];
-    bool no_valid_client = false;
-    int retval, i;
+static bool zc_usable(int dest_fd, int payload_len)
+{
+    if (!zero_copy_enabled || zc_unsupported || payload_len < ZC_MIN_ACL_LEN)
+        return false;
+    /* Spliced payloads never pass through our buffers to be recorded */
+    if (hci_record_active())
+        return false;
+    /* io_uring keeps the stream in userspace buffers, nothing to splice */
+    if (io_backend_get_type() != IO_BACKEND_SELECT || dest_fd <= 0)
+        return false;
+
+    if (zc_pipe[0] < 0) {
+        if (pipe2(zc_pipe, O_CLOEXEC) < 0) {
+            ALOGE("%s: pipe creation failed: %s", __func__, strerror(errno));
+            zc_unsupported = true;
+            return false;
+        }
+        /* Best effort, a bigger pipe takes payloads that arrive in more chunks */
+        fcntl(zc_pipe[1], F_SETPIPE_SZ, ZC_PIPE_SIZE);
+        zc_pipe_slots = fcntl(zc_pipe[1], F_GETPIPE_SZ) / ZC_PAGE_SIZE;
+    }
+    return true;
+}
 
-    ALOGV("%s: Entry.. proto byte : %d\n", __func__, protocol_byte);
-    if (dest_fd == 0) {
-        ALOGE("%s: No valid BT client connection", __func__);
-        /*Discard the packet and keep the read loop alive*/
-        no_valid_client = true;
+/* Moves len payload bytes from src_fd into the pipe. Returns how many made
+ * it; anything short of len is left in the pipe for zc_drain_pipe().
+ */
+static int zc_fill_pipe(int src_fd, int len)
+{
+    int moved = 0, slots = 0, ret;
+
+    while (moved < len) {
+        /* Every splice() takes at least one pipe buffer, never let a slowly
+         * trickling source fill the pipe up and block us on it
+         */
+        if (slots + (len - moved) / ZC_PAGE_SIZE + 2 > zc_pipe_slots)
+            break;
+
+        ret = splice(src_fd, NULL, zc_pipe[1], NULL, len - moved, SPLICE_F_MOVE);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINVAL && moved == 0) {
+                ALOGI("%s: splice not supported on fd %d, copying instead", __func__,
+                      src_fd);
+                zc_unsupported = true;
+            }
+            break;
+        }
+        moved += ret;
+        slots += ret / ZC_PAGE_SIZE + 2;
     }
+    return moved;
+}
 
-    switch(protocol_byte) {
-       case BT_ACL_PACKET_TYPE:
-           retval = do_read(src_fd, hdr, BT_ACL_HDR_SIZE);
-           if (retval < 0) {
-               ALOGE("%s:error in reading hdr: %d",__func__, retval);
-               return -1;
-           }
+static int zc_drain_pipe(unsigned char *buf, int len)
+{
+    unsigned char scratch[256];
+    int ret, done = 0;
+
+    while (done < len) {
+        if (buf)
+            ret = read(zc_pipe[0], buf + done, len - done);
+        else
+            ret = read(zc_pipe[0], scratch, len - done < (int)sizeof(scratch) ?
+                       len - done : (int)sizeof(scratch));
+        if (ret <= 0) {
+            ALOGE("%s: unable to drain pipe: %s", __func__, strerror(errno));
+            return -1;
+        }
+        done += ret;
+    }
+    return done;
+}
 
-           /*ACL data len in two bytes in length*/
-           acl_len = *((unsigned short*)&hdr[BT_ACL_HDR_LEN_OFFSET]);
-           ALOGV("acl_len: %d\n", acl_len);
-           buf = (unsigned char*)calloc(acl_len+BT_ACL_HDR_SIZE+1, sizeof(char));
-           if (buf == NULL) {
-               ALOGE("%s:alloc error", __func__);
-               return -2;
-           }
-           buf[0] = protocol_byte;
-           memcpy(buf+1, hdr, BT_ACL_HDR_SIZE);
+/* Writes the H4 + ACL header, then splices the payload queued in the pipe */
+static int zc_forward(struct filter_instance *inst, int dest_fd, unsigned char *pkt_hdr, int hdr_len, int len,
+                      int direction)
+{
+    int out = 0, ret;
+
+    pthread_mutex_lock(&inst->signal_mutex);
+    /* Whatever UART a recovery left us with, not the one the caller saw */
+    if (direction == HOST_TO_SOC)
+        dest_fd = inst->fd_transport;
+    coalesce_flush(inst, dest_fd, client_coalescer(inst, dest_fd));
+    if (direction == HOST_TO_SOC)
+        ret = uart_write(inst, pkt_hdr, hdr_len);
+    else
+        ret = do_write(dest_fd, pkt_hdr, hdr_len);
+    while (ret >= 0 && out < len) {
+        /* Same rules as uart_write() for every chunk of the payload */
+        if (direction == HOST_TO_SOC && !uart_writable(inst)) {
+            ret = -1;
+            break;
+        }
+        ret = splice(zc_pipe[0], NULL, dest_fd, NULL, len - out, SPLICE_F_MOVE);
+        if (handover_interrupted(ret)) {
+            ret = 0;
+            continue;
+        }
+        if (ret <= 0) {
+            ALOGE("%s: splice to fd %d failed: %s", __func__, dest_fd, strerror(errno));
+            ret = -1;
+            break;
+        }
+        out += ret;
+    }
+    pthread_mutex_unlock(&inst->signal_mutex);
 
-           retval = do_read(src_fd, buf+1+BT_ACL_HDR_SIZE, acl_len);
-           if (retval < 0) {
-               ALOGE("%s:error in reading buf: %d", __func__, retval);
-               retval = -1;
-               free(buf);
-               return retval;
-           }
-           acl_len = acl_len+BT_ACL_HDR_SIZE+1;
-           break;
+    if (ret < 0) {
+        /* Never leave stale payload behind for the next packet */
+        zc_drain_pipe(NULL, len - out);
+        return -1;
+    }
 
-       case BT_SCO_PACKET_TYPE:
-       case BT_CMD_PACKET_TYPE:
-           retval = do_read(src_fd, hdr, BT_SCO_HDR_SIZE);
-           if (retval < 0) {
-               ALOGE("%s:error in reading hdr: %d",__func__, retval);
-               return -1;
-           }
+    __atomic_fetch_add(&zc_bytes, len, __ATOMIC_RELAXED);
+    account_forwarded(inst, direction, hdr_len + len);
+    return hdr_len + len;
+}
 
-           len = hdr[BT_SCO_HDR_LEN_OFFSET];
-           ALOGV("len: %d\n", len);
-           buf = (unsigned char*)calloc(len+BT_SCO_HDR_SIZE+1, sizeof(char));
-           if (buf == NULL) {
-               ALOGE("%s:alloc error", __func__);
-               return -2;
-           }
+static int acl_flow_weight(unsigned short handle)
+{
+    int i;
 
-           buf[0] = protocol_byte;
+    for (i = 0; i < num_acl_weights; i++) {
+        if (acl_weights[i].handle == handle)
+            return acl_weights[i].weight;
+    }
+    return 1;
+}
+
+/* With the scheduler lock held */
+static struct acl_flow *acl_flow_get(struct acl_sched *sched, unsigned short handle)
+{
+    struct acl_flow *flow, *idle = NULL;
+    int i;
+
+    for (i = 0; i < ACL_SCHED_MAX_FLOWS; i++) {
+        flow = &sched->flows[i];
+        if (flow->in_use && flow->handle == handle)
+            return flow;
+        if (idle == NULL && (!flow->in_use || flow->head == NULL))
+            idle = flow;
+    }
+    if (idle == NULL)
+        return NULL;
+
+    if (idle->in_use)
+        ALOGI("%s: handle 0x%03x takes over the slot of 0x%03x", __func__, handle,
+              idle->handle);
+    memset(idle, 0, sizeof(*idle));
+    idle->in_use = true;
+    idle->handle = handle;
+    idle->weight = acl_flow_weight(handle);
+    return idle;
+}
+
+/* Queues one complete H4 ACL packet, waiting while too much is queued */
+static int acl_sched_enqueue(struct filter_instance *inst, unsigned char *buf, int len)
+{
+    struct acl_sched *sched = &inst->acl_sched;
+    unsigned short handle;
+    struct acl_flow *flow;
+    struct acl_pkt *pkt;
+
+    handle = (buf[1] | buf[2] << 8) & ACL_HANDLE_MASK;
+    pkt = (struct acl_pkt *)malloc(sizeof(*pkt) + len);
+    if (pkt == NULL) {
+        ALOGE("%s:alloc error", __func__);
+        return -2;
+    }
+    memcpy(pkt->data, buf, len);
+    pkt->len = len;
+    pkt->next = NULL;
+
+    pthread_mutex_lock(&sched->lock);
+    /* Over the limit rather than stall a handover, the sender is parked */
+    while (sched->queued > 0 && sched->queued + len > ACL_SCHED_MAX_QUEUED &&
+           !handover_quiescing)
+        pthread_cond_wait(&sched->cond, &sched->lock);
+    while ((flow = acl_flow_get(sched, handle)) == NULL)
+        pthread_cond_wait(&sched->cond, &sched->lock);
+
+    pkt->queued_us = get_time_us();
+    if (flow->tail)
+        flow->tail->next = pkt;
+    else
+        flow->head = pkt;
+    flow->tail = pkt;
+    flow->queued += len;
+    sched->queued += len;
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+    return len;
+}
+
+/* Next packet in DRR order, with the scheduler lock held and something queued */
+static struct acl_pkt *acl_sched_next(struct acl_sched *sched, struct acl_flow **out)
+{
+    struct acl_flow *flow;
+    struct acl_pkt *pkt;
+
+    do {
+        flow = &sched->flows[sched->cur];
+        if (flow->head == NULL) {
+            flow->deficit = 0;
+        } else {
+            if (!sched->granted) {
+                flow->deficit += ACL_SCHED_QUANTUM * flow->weight;
+                sched->granted = true;
+            }
+            if (flow->head->len <= flow->deficit)
+                break;
+        }
+        sched->cur = (sched->cur + 1) % ACL_SCHED_MAX_FLOWS;
+        sched->granted = false;
+    } while (1);
+
+    pkt = flow->head;
+    flow->head = pkt->next;
+    if (flow->head == NULL)
+        flow->tail = NULL;
+    flow->deficit -= pkt->len;
+    flow->queued -= pkt->len;
+    sched->queued -= pkt->len;
+    *out = flow;
+    return pkt;
+}
+
+static int acl_sched_thread(struct filter_instance *inst)
+{
+    struct acl_sched *sched = &inst->acl_sched;
+    struct acl_flow *flow;
+    struct acl_pkt *pkt;
+    uint64_t delay;
+    int retval;
+
+    ALOGV("%s: Entry ", __func__);
+    instance_thread_init(inst);
+    pthread_mutex_lock(&sched->lock);
+    do {
+        while (sched->queued == 0 || handover_quiescing) {
+            if (handover_quiescing) {
+                /* What is queued goes along with the handover */
+                pthread_mutex_unlock(&sched->lock);
+                handover_checkpoint(inst, -1, 0);
+                pthread_mutex_lock(&sched->lock);
+                continue;
+            }
+            pthread_cond_wait(&sched->cond, &sched->lock);
+        }
+        pkt = acl_sched_next(sched, &flow);
+        pthread_cond_broadcast(&sched->cond);
+        pthread_mutex_unlock(&sched->lock);
+
+        pthread_mutex_lock(&inst->signal_mutex);
+        retval = uart_write(inst, pkt->data, pkt->len);
+        pthread_mutex_unlock(&inst->signal_mutex);
+        if (retval < 0)
+            ALOGE("%s: error in writing ACL: %s", __func__, strerror(errno));
+        else
+            account_forwarded(inst, HOST_TO_SOC, retval);
+        delay = get_time_us() - pkt->queued_us;
+
+        pthread_mutex_lock(&sched->lock);
+        /* The flow may have been handed to another handle meanwhile */
+        if (flow->in_use && flow->handle == ((pkt->data[1] | pkt->data[2] << 8) &
+                                             ACL_HANDLE_MASK)) {
+            flow->bytes += pkt->len;
+            flow->pkts++;
+            flow->delay_sum_us += delay;
+            if (delay > flow->delay_max_us)
+                flow->delay_max_us = delay;
+        }
+        free(pkt);
+    } while (1);
+
+    pthread_exit(NULL);
+    return 0;
+}
+
+/* BT client went away, its queued ACL is meaningless now */
+static void acl_sched_drop(struct filter_instance *inst)
+{
+    struct acl_sched *sched = &inst->acl_sched;
+    struct acl_pkt *pkt;
+    int i;
+
+    if (!sched->enabled)
+        return;
+
+    pthread_mutex_lock(&sched->lock);
+    for (i = 0; i < ACL_SCHED_MAX_FLOWS; i++) {
+        while ((pkt = sched->flows[i].head) != NULL) {
+            sched->flows[i].head = pkt->next;
+            free(pkt);
+        }
+        memset(&sched->flows[i], 0, sizeof(sched->flows[i]));
+    }
+    sched->queued = 0;
+    sched->granted = false;
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/* Copies the queued ACL into *out in the order it came from the host.
+ * Only called with the sender parked. Returns the bytes copied or -1.
+ */
+static int acl_sched_snapshot(struct filter_instance *inst, unsigned char **out)
+{
+    struct acl_sched *sched = &inst->acl_sched;
+    struct acl_pkt *next[ACL_SCHED_MAX_FLOWS];
+    int i, best, len = 0;
+
+    *out = NULL;
+    if (!sched->enabled)
+        return 0;
+
+    pthread_mutex_lock(&sched->lock);
+    if (sched->queued > 0 && (*out = malloc(sched->queued)) == NULL) {
+        pthread_mutex_unlock(&sched->lock);
+        ALOGE("%s:alloc error", __func__);
+        return -1;
+    }
+    for (i = 0; i < ACL_SCHED_MAX_FLOWS; i++)
+        next[i] = sched->flows[i].head;
+    do {
+        best = -1;
+        for (i = 0; i < ACL_SCHED_MAX_FLOWS; i++) {
+            if (next[i] && (best < 0 || next[i]->queued_us < next[best]->queued_us))
+                best = i;
+        }
+        if (best < 0)
+            break;
+        memcpy(*out + len, next[best]->data, next[best]->len);
+        len += next[best]->len;
+        next[best] = next[best]->next;
+    } while (1);
+    pthread_mutex_unlock(&sched->lock);
+    return len;
+}
+
+static void dump_acl_sched_stats(struct filter_instance *inst)
+{
+    struct acl_sched *sched = &inst->acl_sched;
+    struct acl_flow *flow;
+    int i;
+
+    if (!sched->enabled)
+        return;
+
+    pthread_mutex_lock(&sched->lock);
+    for (i = 0; i < ACL_SCHED_MAX_FLOWS; i++) {
+        flow = &sched->flows[i];
+        if (!flow->in_use || (flow->pkts == 0 && flow->queued == 0))
+            continue;
+        ALOGI("stats(%s acl 0x%03x): weight %d, %llu bytes, %u pkts, %d queued, "
+              "delay avg %llu us max %llu us", inst->uart_dev, flow->handle,
+              flow->weight, (unsigned long long)flow->bytes, flow->pkts, flow->queued,
+              (unsigned long long)(flow->pkts ? flow->delay_sum_us / flow->pkts : 0),
+              (unsigned long long)flow->delay_max_us);
+        flow->pkts = 0;
+        flow->delay_sum_us = 0;
+        flow->delay_max_us = 0;
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/* Controller event in buf (H4 framed): does it belong to diagnostics? */
+static bool diag_wants(unsigned char *buf, int len)
+{
+    unsigned char evt = buf[1], sub;
+
+    switch (diag_evt_route[evt]) {
+        case DIAG_ROUTE_DIAG:
+            return true;
+        case DIAG_ROUTE_SUB:
+            if (len <= 1 + BT_EVT_HDR_SIZE)
+                return false;
+            sub = buf[1 + BT_EVT_HDR_SIZE];
+            return diag_sub_route[evt][sub / 32] & (1U << (sub % 32));
+        default:
+            return false;
+    }
+}
+
+/* Called on the reader thread, never blocks */
+static void diag_queue(struct filter_instance *inst, unsigned char *buf, int len)
+{
+    struct diag_channel *diag = &inst->diag;
+    size_t n;
+
+    pthread_mutex_lock(&diag->lock);
+    if (diag->fd < 0 || diag->used + len > DIAG_QUEUE_SIZE) {
+        diag->dropped++;
+        pthread_mutex_unlock(&diag->lock);
+        return;
+    }
+
+    n = DIAG_QUEUE_SIZE - diag->head;
+    if (n > (size_t)len)
+        n = len;
+    memcpy(diag->queue + diag->head, buf, n);
+    memcpy(diag->queue, buf + n, len - n);
+    diag->head = (diag->head + len) % DIAG_QUEUE_SIZE;
+    diag->used += len;
+    diag->pkts++;
+    diag->bytes += len;
+    pthread_cond_signal(&diag->cond);
+    pthread_mutex_unlock(&diag->lock);
+}
+
+static int diag_open_file(struct diag_channel *diag, bool truncate)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(diag->path, O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : O_APPEND),
+              0640);
+    if (fd < 0) {
+        ALOGE("%s: unable to open %s: %s", __func__, diag->path, strerror(errno));
+        return -1;
+    }
+    diag->file_bytes = fstat(fd, &st) == 0 ? st.st_size : 0;
+    return fd;
+}
+
+/* Keeps the current file and the one before it */
+static int diag_rotate_file(struct diag_channel *diag, int fd)
+{
+    char old[sizeof(diag->path) + 4];
+
+    close(fd);
+    snprintf(old, sizeof(old), "%s.old", diag->path);
+    if (rename(diag->path, old) < 0)
+        ALOGE("%s: unable to rotate %s: %s", __func__, diag->path, strerror(errno));
+    return diag_open_file(diag, true);
+}
+
+static int diag_thread(struct filter_instance *inst)
+{
+    struct diag_channel *diag = &inst->diag;
+    size_t n;
+    int fd = -1, listen_fd = -1, ret;
+
+    ALOGV("%s: Entry ", __func__);
+    do {
+        if (fd < 0) {
+            if (diag_mode == DIAG_SOCKET)
+                fd = establish_remote_socket(diag->sock_name, &listen_fd);
+            else
+                fd = diag_open_file(diag, false);
+            if (fd < 0) {
+                sleep(1);
+                continue;
+            }
+            pthread_mutex_lock(&diag->lock);
+            diag->fd = fd;
+            pthread_mutex_unlock(&diag->lock);
+            ALOGI("%s: %s: diagnostics go to %s", __func__, inst->uart_dev,
+                  diag_mode == DIAG_SOCKET ? diag->sock_name : diag->path);
+        }
+
+        pthread_mutex_lock(&diag->lock);
+        while (diag->used == 0)
+            pthread_cond_wait(&diag->cond, &diag->lock);
+        n = DIAG_QUEUE_SIZE - diag->tail;
+        if (n > diag->used)
+            n = diag->used;
+        pthread_mutex_unlock(&diag->lock);
+
+        /* Producers never touch the bytes between tail and head */
+        ret = write(fd, diag->queue + diag->tail, n);
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        pthread_mutex_lock(&diag->lock);
+        if (ret <= 0) {
+            ALOGE("%s: %s: diagnostics output closed: %s", __func__, inst->uart_dev,
+                  ret < 0 ? strerror(errno) : "EOF");
+            close(fd);
+            fd = diag->fd = -1;
+            diag->head = diag->tail = diag->used = 0;
+        } else {
+            diag->tail = (diag->tail + ret) % DIAG_QUEUE_SIZE;
+            diag->used -= ret;
+        }
+        pthread_mutex_unlock(&diag->lock);
+
+        if (ret > 0 && diag_mode == DIAG_FILE) {
+            diag->file_bytes += ret;
+            if (diag_file_max && diag->file_bytes >= diag_file_max) {
+                fd = diag_rotate_file(diag, fd);
+                pthread_mutex_lock(&diag->lock);
+                diag->fd = fd;
+                pthread_mutex_unlock(&diag->lock);
+            }
+        }
+    } while (1);
+
+    pthread_exit(NULL);
+    return 0;
+}
+
+static void dump_diag_stats(struct filter_instance *inst)
+{
+    struct diag_channel *diag = &inst->diag;
+
+    if (diag_mode == DIAG_OFF)
+        return;
+
+    pthread_mutex_lock(&diag->lock);
+    ALOGI("stats(%s): diag %llu pkts %llu bytes, %llu dropped, %zu queued", inst->uart_dev,
+          (unsigned long long)diag->pkts, (unsigned long long)diag->bytes,
+          (unsigned long long)diag->dropped, diag->used);
+    pthread_mutex_unlock(&diag->lock);
+}
+
+int copy_bt_data_to_channel(struct filter_instance *inst, int src_fd, int dest_fd,
+                            unsigned char protocol_byte,int direction) {
+    unsigned char len;
+    unsigned short acl_len;
+    unsigned char* buf;
+    unsigned char hdr[MAX_BT_HDR_SIZE];
+    bool no_valid_client = false;
+    int retval, in_pipe = 0;
+
+    ALOGV("%s: Entry.. proto byte : %d\n", __func__, protocol_byte);
+    if (dest_fd == 0 && !(direction == SOC_TO_HOST && bt_client_present(inst))) {
+        ALOGE("%s: No valid BT client connection", __func__);
+        /*Discard the packet and keep the read loop alive*/
+        no_valid_client = true;
+    }
+
+    switch(protocol_byte) {
+       case BT_ACL_PACKET_TYPE:
+           retval = do_read(src_fd, hdr, BT_ACL_HDR_SIZE);
+           if (retval < 0) {
+               ALOGE("%s:error in reading hdr: %d",__func__, retval);
+               return -1;
+           }
+
+           /*ACL data len in two bytes in length*/
+           acl_len = *((unsigned short*)&hdr[BT_ACL_HDR_LEN_OFFSET]);
+           ALOGV("acl_len: %d\n", acl_len);
+
+           /* Host ACL has to queue for the scheduler when it is on */
+           if (!no_valid_client && inst->remote_bt_fd != 0 && client_shm(inst, dest_fd) == NULL &&
+               !(direction == HOST_TO_SOC && inst->acl_sched.enabled) &&
+               !pkt_hooks_want(direction, protocol_byte) &&
+               zc_usable(dest_fd, acl_len)) {
+               unsigned char pkt_hdr[BT_ACL_HDR_SIZE+1];
+
+               in_pipe = zc_fill_pipe(src_fd, acl_len);
+               if (in_pipe == acl_len) {
+                   pkt_hdr[0] = protocol_byte;
+                   memcpy(pkt_hdr+1, hdr, BT_ACL_HDR_SIZE);
+                   retval = zc_forward(inst, dest_fd, pkt_hdr, sizeof(pkt_hdr), acl_len,
+                                       direction);
+                   if (retval < 0 && (errno == EPIPE || errno == EBADF)) {
+                       ALOGV("%s: BT has closed of the other end", __func__);
+                       retval = 0;
+                   }
+                   return retval;
+               }
+               /* Could not take the whole payload, finish it by copying */
+           }
+
+           buf = (unsigned char*)calloc(acl_len+BT_ACL_HDR_SIZE+1, sizeof(char));
+           if (buf == NULL) {
+               ALOGE("%s:alloc error", __func__);
+               return -2;
+           }
+           buf[0] = protocol_byte;
+           memcpy(buf+1, hdr, BT_ACL_HDR_SIZE);
+
+           if (in_pipe > 0 && zc_drain_pipe(buf+1+BT_ACL_HDR_SIZE, in_pipe) < 0) {
+               free(buf);
+               return -1;
+           }
+           retval = do_read(src_fd, buf+1+BT_ACL_HDR_SIZE+in_pipe, acl_len-in_pipe);
+           if (retval < 0) {
+               ALOGE("%s:error in reading buf: %d", __func__, retval);
+               retval = -1;
+               free(buf);
+               return retval;
+           }
+           acl_len = acl_len+BT_ACL_HDR_SIZE+1;
+           break;
+
+       case BT_SCO_PACKET_TYPE:
+       case BT_CMD_PACKET_TYPE:
+           retval = do_read(src_fd, hdr, BT_SCO_HDR_SIZE);
+           if (retval < 0) {
+               ALOGE("%s:error in reading hdr: %d",__func__, retval);
+               return -1;
+           }
+
+           len = hdr[BT_SCO_HDR_LEN_OFFSET];
+           ALOGV("len: %d\n", len);
+           buf = (unsigned char*)calloc(len+BT_SCO_HDR_SIZE+1, sizeof(char));
+           if (buf == NULL) {
+               ALOGE("%s:alloc error", __func__);
+               return -2;
+           }
+
+           buf[0] = protocol_byte;
            memcpy(buf+1, hdr, BT_SCO_HDR_SIZE);
            retval = do_read(src_fd, buf+BT_SCO_HDR_SIZE+1, len);
            if (retval < 0) {
@@ -615,36 +2565,107 @@ int copy_bt_data_to_channel(int src_fd, int dest_fd, unsigned char protocol_byte
           ALOGE("%s: packet type error", __func__);
           return -3;
      }
-     if (no_valid_client || remote_bt_fd == 0) {
+     if (direction == SOC_TO_HOST && protocol_byte == BT_EVT_PACKET_TYPE &&
+         (buf[1] == BT_EVT_CMD_CMPL || buf[1] == BT_EVT_CMD_STATUS)) {
+          /* Controller is answering, nothing outstanding any more */
+          int64_t sent_us = inst->prof_stats.cmd_sent_us;
+
+          inst->wdog.cmd_sent_ms = 0;
+          inst->wdog.vendor_cmd = false;
+          rsp_cache_capture(inst, buf, acl_len);
+          if (sent_us) {
+              uint64_t rtt = get_time_us() - sent_us;
+
+              inst->prof_stats.cmd_sent_us = 0;
+              inst->prof_stats.rtt_sum_us += rtt;
+              inst->prof_stats.rtt_count++;
+              if (rtt > inst->prof_stats.rtt_max_us)
+                  inst->prof_stats.rtt_max_us = rtt;
+          }
+     }
+     if (direction == SOC_TO_HOST && protocol_byte == BT_EVT_PACKET_TYPE &&
+         diag_mode != DIAG_OFF && diag_wants(buf, acl_len)) {
+          diag_queue(inst, buf, acl_len);
+          free(buf);
+          return 0;
+     }
+     if (direction == SOC_TO_HOST && protocol_byte == BT_EVT_PACKET_TYPE &&
+         buf[1] == BT_EVT_VENDOR && inst->wdog.vendor_cmd) {
+          /* QCA vendor commands are answered by a vendor specific event */
+          inst->wdog.cmd_sent_ms = 0;
+          inst->wdog.vendor_cmd = false;
+          inst->prof_stats.cmd_sent_us = 0;
+     }
+     if (no_valid_client || !bt_client_present(inst)) {
           /*Discard the packet and keep the read loop alive*/
           ALOGE("BT is turned off in b/w, keep back in loop");
           free(buf);
           return 0;
      }
-#ifdef DEBUG_MIMIC_CMD_TOUT
-     if ( command_is_change_lname(buf, acl_len) ) {
-         ALOGE("Drop the change local name cmd");
-         free(buf);
-         return 0;
+     retval = forward_bt_packet(inst, src_fd, dest_fd, buf, acl_len, direction);
+     free(buf);
+     return retval;
+}
+
+/* Commands the controller never answers must not arm the stall timer */
+static bool cmd_expects_reply(unsigned char *buf, int len)
+{
+    unsigned short opcode;
+
+    if (len < 1 + BT_CMD_HDR_SIZE)
+        return false;
+    opcode = buf[BT_CMD_OPCODE_OFFSET] | buf[BT_CMD_OPCODE_OFFSET + 1] << 8;
+    return opcode != HCI_HOST_NUM_COMPLETED_PKTS;
+}
+
+/* Hands a complete H4 BT packet in buf to dest_fd. src_fd is where it came
+ * from, cached command answers go back there.
+ */
+static int forward_bt_packet(struct filter_instance *inst, int src_fd, int dest_fd,
+                             unsigned char *buf, int len, int direction) {
+     unsigned char protocol_byte = buf[0];
+     bool armed = false;
+     int retval, i;
+
+     hci_record(HCI_REC_PACKET, inst->index, HCI_REC_CHAN_BT, direction, buf, len);
+
+     if (run_pkt_hooks(inst, src_fd, buf, len, direction) == HOOK_CONSUMED)
+         return len;
+     if (direction == HOST_TO_SOC && protocol_byte == BT_CMD_PACKET_TYPE) {
+         //Dont write it controller if the answer is already known
+         retval = rsp_cache_handle_cmd(inst, src_fd, buf, len);
+         if (retval != 0)
+             return retval;
      }
-#endif //DEBUG_MIMIC_CMD_TOUT
-#ifdef IGNORE_HCI_RESET
-      if (acl_len == 4 && command_is_reset(buf, acl_len))
-      {
-         ALOGV("It is an HCI_RESET Command ");
-         //Dont write it controller rather mimmc success event
-         retval = write (src_fd, reset_cmpl, 7);
-         if (retval < 0) {
-              ALOGE("%s: error while writing hci_reset_cmp", __func__);
-         }
-         free(buf);
-         return retval;
-      }
-#endif//IGNORE_HCI_RESET
 
-     pthread_mutex_lock(&signal_mutex);
-     retval = do_write(dest_fd, buf, acl_len);
-     pthread_mutex_unlock(&signal_mutex);
+     if (direction == HOST_TO_SOC && protocol_byte == BT_ACL_PACKET_TYPE &&
+         inst->acl_sched.enabled)
+         return acl_sched_enqueue(inst, buf, len);
+
+     if (direction == SOC_TO_HOST && inst->bt_cb.bt_recv != NULL) {
+         retval = bt_cb_deliver(inst, buf, len);
+     } else {
+         pthread_mutex_lock(&inst->signal_mutex);
+         if (direction == SOC_TO_HOST) {
+             retval = client_write(inst, dest_fd, buf, len);
+         } else {
+             /* Arm before the write, the answer may beat us to the reader */
+             if (protocol_byte == BT_CMD_PACKET_TYPE && inst->wdog.cmd_sent_ms == 0 &&
+                 cmd_expects_reply(buf, len)) {
+                 inst->wdog.vendor_cmd = (buf[BT_CMD_OPCODE_OFFSET + 1] >> 2) == HCI_OGF_VENDOR;
+                 inst->prof_stats.cmd_sent_us = get_time_us();
+                 inst->wdog.cmd_sent_ms = get_time_ms();
+                 armed = true;
+             }
+             retval = uart_write(inst, buf, len);
+             if (retval < 0 && armed) {
+                 inst->wdog.cmd_sent_ms = 0;
+                 inst->wdog.vendor_cmd = false;
+                 inst->prof_stats.cmd_sent_us = 0;
+             }
+         }
+         pthread_mutex_unlock(&inst->signal_mutex);
+     }
      if (retval < 0) {
          ALOGE("%s:error in writing buf: %d: %s", __func__, retval, strerror(errno));
          if (errno == EPIPE || errno == EBADF) {
@@ -654,24 +2675,25 @@ int copy_bt_data_to_channel(int src_fd, int dest_fd, unsigned char protocol_byte
          } else {
              retval = -1;
          }
-         free(buf);
          return retval;
      }
 
-     ALOGV("Direction(%d): bytes: %d : bytes_written: %d", direction, acl_len, retval);
-     for (i =0; i<acl_len; i++) {
+     account_forwarded(inst, direction, retval);
+
+     ALOGV("Direction(%d): bytes: %d : bytes_written: %d", direction, len, retval);
+     for (i =0; i<len; i++) {
          ALOGV("%x-", buf[i]);
      }
      ALOGV("*done");
 
-     ALOGV("%s: copied bt data/cmd (of len %d) succesfully\n", __func__, acl_len);
+     ALOGV("%s: copied bt data/cmd (of len %d) succesfully\n", __func__, len);
 
-     free(buf);
      return retval;
 }
 
 
-int copy_ant_host_data_to_soc(int src_fd, int dest_fd, unsigned char protocol_byte) {
+int copy_ant_host_data_to_soc(struct filter_instance *inst, int src_fd, int dest_fd,
+                              unsigned char protocol_byte) {
     unsigned char hdr[ANT_CMD_HDR_SIZE];
     int len;
     unsigned char *ant_pl;
@@ -709,10 +2731,12 @@ int copy_ant_host_data_to_soc(int src_fd, int dest_fd, unsigned char protocol_by
     }
 
     memcpy(ant_pl, hdr, ANT_CMD_HDR_SIZE);
+    hci_record(HCI_REC_PACKET, inst->index, HCI_REC_CHAN_ANT, HCI_REC_HOST_TO_SOC,
+               ant_pl, len + ANT_CMD_HDR_SIZE);
 
-    pthread_mutex_lock(&signal_mutex);
-    retval = do_write(dest_fd, ant_pl, len+ANT_CMD_HDR_SIZE);
-    pthread_mutex_unlock(&signal_mutex);
+    pthread_mutex_lock(&inst->signal_mutex);
+    retval = uart_write(inst, ant_pl, len+ANT_CMD_HDR_SIZE);
+    pthread_mutex_unlock(&inst->signal_mutex);
     if (retval < 0) {
         ALOGE("write returns err: file_desc: %d %d(%s)\n", dest_fd, retval,strerror(errno));
         retval = -1;
@@ -720,6 +2744,7 @@ int copy_ant_host_data_to_soc(int src_fd, int dest_fd, unsigned char protocol_by
         return retval;
     }
 
+    account_forwarded(inst, HOST_TO_SOC, retval);
     ALOGV("ANT host bytes sent*");
     for (i =0; i<retval; i++) {
          ALOGV("%x-", ant_pl[i]);
@@ -729,7 +2754,7 @@ int copy_ant_host_data_to_soc(int src_fd, int dest_fd, unsigned char protocol_by
     return retval;
 }
 
-int copy_ant_data_to_channel(int src_fd, int dest_fd, unsigned char protocol_byte)
+int copy_ant_data_to_channel(struct filter_instance *inst, int src_fd, int dest_fd, unsigned char protocol_byte)
 {
     unsigned char len;
     unsigned char* ant_pl;
@@ -737,7 +2762,7 @@ int copy_ant_data_to_channel(int src_fd, int dest_fd, unsigned char protocol_byt
 
     ALOGV("%s: Entry ", __func__);
 
-    int ret = read (src_fd, &len, 1);
+    int ret = io_read(src_fd, &len, 1);
     if (ret < 0) {
         ALOGE("%s: read length returns err: %d\n", __func__,ret);
         return -1;
@@ -759,7 +2784,12 @@ int copy_ant_data_to_channel(int src_fd, int dest_fd, unsigned char protocol_byt
         return retval;
     }
 
-    if (remote_ant_fd == 0) {
+    ant_pl[0] = protocol_byte;
+    ant_pl[1] = len;
+    hci_record(HCI_REC_PACKET, inst->index, HCI_REC_CHAN_ANT, HCI_REC_SOC_TO_HOST,
+               ant_pl + 1, ret + 1);
+
+    if (inst->remote_ant_fd == 0) {
         /*Discard the packet and keep the read loop alive*/
         free(ant_pl);
         return 0;
@@ -768,11 +2798,9 @@ int copy_ant_data_to_channel(int src_fd, int dest_fd, unsigned char protocol_byt
     if (ret < len)
         ALOGV("%s: expected %d bytes, recieved only %d", __func__, len, ret);
 
-    ant_pl[0] = protocol_byte;
-    ant_pl[1] = len;
-    pthread_mutex_lock(&signal_mutex);
-    ret = do_write(dest_fd, ant_pl+1, ret+1);
-    pthread_mutex_unlock(&signal_mutex);
+    pthread_mutex_lock(&inst->signal_mutex);
+    ret = client_write(inst, dest_fd, ant_pl+1, ret+1);
+    pthread_mutex_unlock(&inst->signal_mutex);
 
     if (ret < 0) {
         ALOGE("write returns err: file_desc: %d %d(%s)\n", dest_fd, ret,strerror(errno));
@@ -787,6 +2815,7 @@ int copy_ant_data_to_channel(int src_fd, int dest_fd, unsigned char protocol_byt
         return retval;
     }
 
+    account_forwarded(inst, SOC_TO_HOST, ret);
     ALOGV("ANT event bytes sent*");
     for (i =0; i<ret; i++) {
          ALOGV("%x-", ant_pl[i]);
@@ -800,35 +2829,36 @@ int copy_ant_data_to_channel(int src_fd, int dest_fd, unsigned char protocol_byt
     return retval;
 }
 
-int handle_soc_events(int fd_transport) {
+int handle_soc_events(struct filter_instance *inst) {
     unsigned char first_byte;
     int retval;
     ALOGV("%s: Entry ", __func__);
 
-    retval = read (fd_transport, &first_byte, 1);
+    retval = io_read(inst->fd_transport, &first_byte, 1);
     if (retval < 0) {
         ALOGE("%s:read returns err: %d\n", __func__,retval);
         return -1;
     }
 
+    inst->wdog.last_rx_ms = get_time_ms();
     ALOGV("%s: protocol_byte: %x", __func__, first_byte);
 
     switch(first_byte) {
         case ANT_CTL_PACKET_TYPE:
         case ANT_DATA_PACKET_TYPE:
             ALOGV("%s: Ant data", __func__);
-            retval = copy_ant_data_to_channel(fd_transport, remote_ant_fd, first_byte);
+            retval = copy_ant_data_to_channel(inst, inst->fd_transport, inst->remote_ant_fd, first_byte);
             ALOGV("%s: copy_ant_data_to_channel returns %d", __func__, retval);
             break;
         case BT_EVT_PACKET_TYPE:
         case BT_ACL_PACKET_TYPE:
             ALOGV("%s: BT data", __func__);
-            retval = copy_bt_data_to_channel(fd_transport, remote_bt_fd, first_byte,SOC_TO_HOST);
+            retval = copy_bt_data_to_channel(inst, inst->fd_transport, inst->remote_bt_fd, first_byte,SOC_TO_HOST);
             break;
         default:
             ALOGE("%s: Unexpected data format!!:%x - Ignore the Packet ",__func__,first_byte);
             //retval = -1;
-            tcflush(fd_transport, TCIFLUSH);
+            tcflush(inst->fd_transport, TCIFLUSH);
             retval = 0 ;
     }
 
@@ -836,42 +2866,308 @@ int handle_soc_events(int fd_transport) {
     return retval;
 }
 
-static int start_reader_thread() {
-    fd_set input;
+static void notify_clients_ssr(struct filter_instance *inst)
+{
+    unsigned char marker = BT_SSR_TRIGGERED;
+
+    pthread_mutex_lock(&inst->signal_mutex);
+    coalesce_flush(inst, inst->remote_bt_fd, &inst->bt_coal);
+    coalesce_flush(inst, inst->remote_ant_fd, &inst->ant_coal);
+    if (inst->remote_bt_fd > 0 && write(inst->remote_bt_fd, &marker, 1) < 0)
+        ALOGE("%s: failed to notify BT client: %s", __func__, strerror(errno));
+    if (inst->remote_ant_fd > 0 && write(inst->remote_ant_fd, &marker, 1) < 0)
+        ALOGE("%s: failed to notify ANT client: %s", __func__, strerror(errno));
+    pthread_mutex_unlock(&inst->signal_mutex);
+    if (inst->bt_cb.bt_recv != NULL)
+        bt_cb_deliver(inst, NULL, 0);
+}
+
+/* Takes signal_mutex for the recovery, kicking whoever is stuck writing to
+ * the UART while holding it. Returns -1 if it could not be had in time.
+ */
+static int recover_lock(struct filter_instance *inst)
+{
+    int64_t deadline = get_time_ms() + WDOG_RECOVER_LOCK_MS;
+    struct timespec ts;
+
+    do {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += WDOG_KICK_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        if (pthread_mutex_timedlock(&inst->signal_mutex, &ts) == 0)
+            return 0;
+        wdog_kick_threads(inst);
+    } while (get_time_ms() < deadline);
+    return -1;
+}
+
+/* Runs on the reader thread: re-open the UART in place of the wedged one */
+static int recover_transport(struct filter_instance *inst)
+{
+    int64_t start = get_time_ms();
+
+    ALOGE("%s: controller stalled, re-initializing %s", __func__, inst->uart_dev);
+
+    if (recover_lock(inst) < 0) {
+        ALOGE("%s: %s still held by a blocked writer after %d ms", __func__,
+              inst->uart_dev, WDOG_RECOVER_LOCK_MS);
+        /* Nothing short of a restart gets the UART back. The stack's own
+         * command timeout deals with it in library mode.
+         */
+        if (!library_mode) {
+            hci_record_close();
+            filter_property_set("vendor.wc_transport.hci_filter_status", "0");
+            filter_property_set("vendor.wc_transport.start_hci", "false");
+            _exit(1);
+        }
+        return -1;
+    }
+    if (inst->fd_transport > 0)
+        io_close(inst->fd_transport);
+    inst->fd_transport = init_transport(inst);
+    pthread_mutex_unlock(&inst->signal_mutex);
+
+    inst->wdog.cmd_sent_ms = 0;
+    inst->wdog.last_rx_ms = get_time_ms();
+    inst->wdog.recovery_requested = 0;
+    rsp_cache_invalidate(inst, "SSR");
+
+    if (inst->fd_transport < 0) {
+        ALOGE("%s: unable to re-initialize %s", __func__, inst->uart_dev);
+        return -1;
+    }
+
+    notify_clients_ssr(inst);
+
+    inst->wdog.recoveries++;
+    inst->wdog.last_recovery_ms = get_time_ms() - start;
+    ALOGI("%s: %s recovery #%u completed in %lld ms", __func__, inst->uart_dev,
+          inst->wdog.recoveries,
+          (long long)inst->wdog.last_recovery_ms);
+    return inst->fd_transport;
+}
+
+static void wdog_sig_handler(int sig)
+{
+    (void)sig;
+}
+
+/* Voluntary context switches of the reader, i.e. how often it slept and woke */
+static uint64_t read_reader_csw(struct filter_instance *inst)
+{
+    char path[64], line[128];
+    unsigned long long csw = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/status", inst->prof_stats.reader_tid);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "voluntary_ctxt_switches: %llu", &csw) == 1)
+            break;
+    }
+    fclose(f);
+    return csw;
+}
+
+static void dump_profile_stats(struct filter_instance *inst, int64_t now)
+{
+    uint64_t csw = read_reader_csw(inst);
+    int64_t elapsed = now - inst->prof_stats.last_ms;
+    unsigned int count = inst->prof_stats.rtt_count;
+
+    if (elapsed <= 0)
+        return;
+
+    ALOGI("stats(%s, %s profile): %llu reader wakeups/s, cmd latency avg %llu us "
+          "max %llu us over %u cmds", inst->uart_dev, inst->uart_profile->name,
+          (unsigned long long)((csw - inst->prof_stats.last_csw) * 1000 / elapsed),
+          (unsigned long long)(count ? inst->prof_stats.rtt_sum_us / count : 0),
+          (unsigned long long)inst->prof_stats.rtt_max_us, count);
+
+    inst->prof_stats.last_csw = csw;
+    inst->prof_stats.last_ms = now;
+    inst->prof_stats.rtt_sum_us = 0;
+    inst->prof_stats.rtt_max_us = 0;
+    inst->prof_stats.rtt_count = 0;
+}
+
+static void dump_instance_stats(struct filter_instance *inst, int64_t now)
+{
+    int64_t elapsed = now - inst->prof_stats.last_ms;
+    uint64_t bytes[2];
+    int dir;
+
+    if (elapsed <= 0)
+        return;
+
+    for (dir = HOST_TO_SOC; dir <= SOC_TO_HOST; dir++)
+        bytes[dir] = __atomic_load_n(&inst->bytes[dir], __ATOMIC_RELAXED);
+
+    ALOGI("stats(%s): host->soc %llu pkts %llu B/s, soc->host %llu pkts %llu B/s, "
+          "%u recoveries (last %lld ms), cache %u hits %u misses", inst->uart_dev,
+          (unsigned long long)inst->pkts[HOST_TO_SOC],
+          (unsigned long long)((bytes[HOST_TO_SOC] - inst->last_bytes[HOST_TO_SOC]) *
+                               1000 / elapsed),
+          (unsigned long long)inst->pkts[SOC_TO_HOST],
+          (unsigned long long)((bytes[SOC_TO_HOST] - inst->last_bytes[SOC_TO_HOST]) *
+                               1000 / elapsed),
+          inst->wdog.recoveries, (long long)inst->wdog.last_recovery_ms,
+          inst->rsp_cache_hits, inst->rsp_cache_misses);
+
+    inst->last_bytes[HOST_TO_SOC] = bytes[HOST_TO_SOC];
+    inst->last_bytes[SOC_TO_HOST] = bytes[SOC_TO_HOST];
+
+    if (inst->bt_coal.budget_us > 0 || inst->ant_coal.budget_us > 0) {
+        /* every packet that rode along in a batch is one client wakeup less */
+        ALOGI("stats(%s): coalesced %llu pkts into %llu writes, %llu wakeups saved",
+              inst->uart_dev, (unsigned long long)inst->coal_pkts,
+              (unsigned long long)inst->coal_writes,
+              (unsigned long long)(inst->coal_pkts - inst->coal_writes));
+    }
+}
+
+static void dump_stats()
+{
+    struct io_stats st;
+    struct shm_ring_stats shm;
+
+    io_get_stats(&st);
+    ALOGI("stats(%s): rx %llu bytes in %llu reads, tx %llu bytes in %llu writes, "
+          "%llu waits, %llu submits, %llu spliced bytes",
+          io_backend_name(), (unsigned long long)st.rx_bytes,
+          (unsigned long long)st.read_calls, (unsigned long long)st.tx_bytes,
+          (unsigned long long)st.write_calls, (unsigned long long)st.wait_calls,
+          (unsigned long long)st.submit_calls,
+          (unsigned long long)__atomic_load_n(&zc_bytes, __ATOMIC_RELAXED));
+
+    if (!shm_ring_enabled)
+        return;
+    shm_ring_get_stats(&shm);
+    ALOGI("stats(shm): %llu pkts to hosts, %llu from hosts, %llu doorbells, "
+          "%llu suppressed, %llu full waits", (unsigned long long)shm.tx_pkts,
+          (unsigned long long)shm.rx_pkts, (unsigned long long)shm.kicks,
+          (unsigned long long)shm.suppressed, (unsigned long long)shm.full_waits);
+}
+
+/* One watchdog serves every instance */
+static int wdog_thread_fn() {
+    struct filter_instance *inst;
+    int64_t now, cmd_ms, last_dump_ms;
+    bool dump;
+    int i;
+
+    ALOGV("%s: Entry ", __func__);
+    last_dump_ms = get_time_ms();
+    do {
+        usleep(WDOG_POLL_MS * 1000);
+        hci_record_flush();
+
+        now = get_time_ms();
+        dump = stats_interval_ms > 0 && now - last_dump_ms >= stats_interval_ms;
+        if (dump) {
+            dump_stats();
+            dump_hook_stats();
+            last_dump_ms = now;
+        }
+        check_pkt_hooks();
+
+        for (i = 0; i < num_instances; i++) {
+            inst = &instances[i];
+            if (dump) {
+                dump_instance_stats(inst, now);
+                dump_acl_sched_stats(inst);
+                dump_diag_stats(inst);
+                dump_profile_stats(inst, now);
+            }
+            /* Hands off the UART while it is being passed on, or once it is gone */
+            if (handover_quiescing || inst->uart_dead)
+                continue;
+            check_uart_profile(inst);
+
+            cmd_ms = inst->wdog.cmd_sent_ms;
+            if (cmd_ms && now - cmd_ms > WDOG_CMD_TOUT_MS &&
+                now - inst->wdog.last_rx_ms > WDOG_SILENCE_MS) {
+                ALOGE("%s: %s: cmd outstanding for %lld ms, UART silent for %lld ms",
+                      __func__, inst->uart_dev, (long long)(now - cmd_ms),
+                      (long long)(now - inst->wdog.last_rx_ms));
+                wdog_request_recovery(inst, "controller stall");
+            }
+        }
+    } while(1);
+
+    pthread_exit(NULL);
+    return 0;
+}
+
+static int start_reader_thread(struct filter_instance *inst) {
     int n = 0, retval;
     ALOGV("%s: Entry ", __func__);
 
-    if ((fd_transport = init_transport()) == -1) {
-        ALOGE("unable to initialize transport %s", BT_HS_UART_DEVICE);
+    instance_thread_init(inst);
+    inst->wdog.last_rx_ms = get_time_ms();
+    inst->prof_stats.reader_tid = gettid();
+    inst->prof_stats.last_ms = get_time_ms();
+    inst->prof_stats.last_csw = read_reader_csw(inst);
+
+    if (inst->fd_transport > 0) {
+        /* Opened by filter_start() in library mode, or handed over by the
+         * previous filter with the controller up already
+         */
+        if (!library_mode)
+            ALOGI("%s: %s taken over", __func__, inst->uart_dev);
+    } else if ((inst->fd_transport = init_transport(inst)) == -1) {
+        ALOGE("unable to initialize transport %s", inst->uart_dev);
+        inst->fd_transport = 0;
+        inst->uart_dead = true;
+        inst->reader_ret = -1;
+        instance_thread_exit(inst, INST_THREAD_READER);
         return -1;
     }
+    check_uart_profile(inst);
 
     /*Indicate that, server is ready to accept*/
-    property_set("vendor.wc_transport.hci_filter_status", "1");
-
-    FD_ZERO(&input);
-    FD_SET(fd_transport, &input);
+    if (inst->index == 0 && !library_mode)
+        filter_property_set("vendor.wc_transport.hci_filter_status", "1");
 
     do {
+        if (inst->wdog.recovery_requested && recover_transport(inst) < 0) {
+            retval = -1;
+            break;
+        }
+        handover_checkpoint(inst, HANDOVER_UART, inst->fd_transport);
+
         ALOGV("%s: Selecting on transport for events", __func__);
-        n = select (fd_transport+1, &input, NULL, NULL, NULL);
+        n = io_wait_readable_timeout(inst->fd_transport, coalesce_service(inst));
+        if (n == 0) {
+            /* Held packets are due */
+            continue;
+        }
 
         if(n < 0){
+            if (errno == EINTR)
+                continue;
             ALOGE("Select failed: %s", strerror(errno));
             retval = -1;
             break;
         }
 
         ALOGV("%s: Select comes out\n", __func__);
-        if (fd_transport < 0) {
+        if (inst->fd_transport < 0) {
             ALOGE("%s: fd_transport is already deinit, exit loop",__func__);
             retval = -1;
             break;
         }
 
-        if (FD_ISSET(fd_transport, &input)) {
-             retval = handle_soc_events(fd_transport);
+        if (n > 0) {
+             retval = handle_soc_events(inst);
              if(retval < 0) {
+                 if (inst->wdog.recovery_requested)
+                     continue;
                  ALOGE("%s: handle_soc_events returns: %d: ", __func__, retval);
                  retval = -1;
                  break;
@@ -879,8 +3175,23 @@ static int start_reader_thread() {
         }
     } while(1);
 
-    close(fd_transport);
-    fd_transport = 0;
+    /* Writers check uart_dead under signal_mutex, so none is left on the
+     * UART once we hold it
+     */
+    inst->uart_dead = true;
+    if (recover_lock(inst) == 0) {
+        if (inst->fd_transport > 0)
+            io_close(inst->fd_transport);
+        inst->fd_transport = 0;
+        pthread_mutex_unlock(&inst->signal_mutex);
+    } else {
+        ALOGE("%s: %s left to its blocked writer", __func__, inst->uart_dev);
+    }
+    /* The stack's process carries on without us, let it tear BT down */
+    if (inst->bt_cb.bt_recv != NULL)
+        bt_cb_deliver(inst, NULL, 0);
+    inst->reader_ret = retval;
+    instance_thread_exit(inst, INST_THREAD_READER);
     ALOGV("%s: Exit %d", __func__, retval);
     return retval;
 }
@@ -897,43 +3208,788 @@ int cleanup_thread(pthread_t thread) {
     return status;
 }
 
-int main() {
+/* vendor.wc_transport.diag_events: "evt" diverts every event with that code,
+ * "evt:sub" only those whose first parameter is sub (vendor sub-event)
+ */
+static void parse_diag_events()
+{
+    char value[PROPERTY_VALUE_MAX] = {'\0'};
+    char *entry, *sep, *saveptr = NULL;
+    long evt, sub;
+
+    filter_property_get("vendor.wc_transport.diag_events", value, DIAG_EVENTS_DEFAULT);
+    for (entry = strtok_r(value, ", ", &saveptr); entry != NULL;
+         entry = strtok_r(NULL, ", ", &saveptr)) {
+        sep = strchr(entry, ':');
+        if (sep != NULL)
+            *sep++ = '\0';
+        evt = strtol(entry, NULL, 0);
+        sub = sep != NULL ? strtol(sep, NULL, 0) : -1;
+        if (evt < 0 || evt > 0xff || sub > 0xff) {
+            ALOGE("%s: ignoring diag event %s", __func__, entry);
+            continue;
+        }
+        if (sub < 0) {
+            diag_evt_route[evt] = DIAG_ROUTE_DIAG;
+        } else if (diag_evt_route[evt] != DIAG_ROUTE_DIAG) {
+            diag_evt_route[evt] = DIAG_ROUTE_SUB;
+            diag_sub_route[evt][sub / 32] |= 1U << (sub % 32);
+        }
+        ALOGI("%s: event 0x%02lx%s diverted to diagnostics", __func__, evt,
+              sub < 0 ? "" : " (sub-event)");
+    }
+}
+
+static void parse_acl_weights()
+{
+    char value[PROPERTY_VALUE_MAX] = {'\0'};
+    char *entry, *sep, *saveptr = NULL;
+    long handle, weight;
+
+    filter_property_get("vendor.wc_transport.acl_weights", value, "");
+    for (entry = strtok_r(value, ", ", &saveptr); entry != NULL;
+         entry = strtok_r(NULL, ", ", &saveptr)) {
+        sep = strchr(entry, ':');
+        if (sep == NULL || num_acl_weights == ACL_SCHED_MAX_FLOWS) {
+            ALOGE("%s: ignoring acl weight %s", __func__, entry);
+            continue;
+        }
+        *sep = '\0';
+        handle = strtol(entry, NULL, 0);
+        weight = strtol(sep + 1, NULL, 0);
+        if (handle < 0 || handle > ACL_HANDLE_MASK || weight < 1 || weight > 64) {
+            ALOGE("%s: invalid acl weight %s:%s", __func__, entry, sep + 1);
+            continue;
+        }
+        acl_weights[num_acl_weights].handle = handle;
+        acl_weights[num_acl_weights].weight = weight;
+        num_acl_weights++;
+        ALOGI("%s: handle 0x%03lx weight %ld", __func__, handle, weight);
+    }
+}
+
+static int setup_instances()
+{
+    char value[PROPERTY_VALUE_MAX] = {'\0'};
+    struct filter_instance *inst;
+    char *dev, *saveptr = NULL;
+    int bt_coal_us, ant_coal_us;
+    bool acl_sched;
+    long ncpus;
+    int i;
+
+    filter_property_get("vendor.wc_transport.acl_sched", value, "0");
+    acl_sched = !strcmp(value, "1") || !strcmp(value, "drr");
+    if (acl_sched)
+        parse_acl_weights();
+
+    filter_property_get("vendor.wc_transport.diag", value, "off");
+    if (!strcmp(value, "socket"))
+        diag_mode = DIAG_SOCKET;
+    else if (!strcmp(value, "file"))
+        diag_mode = DIAG_FILE;
+    else if (strcmp(value, "off"))
+        ALOGE("%s: unknown diag mode %s", __func__, value);
+    if (diag_mode != DIAG_OFF) {
+        parse_diag_events();
+        filter_property_get("vendor.wc_transport.diag_file_kb", value, "");
+        diag_file_max = (value[0] ? (size_t)atol(value) : DIAG_FILE_KB_DEFAULT) * 1024;
+        filter_property_get("vendor.wc_transport.diag_path", diag_path, DIAG_PATH_DEFAULT);
+    }
+
+    filter_property_get("vendor.wc_transport.coalesce_bt_us", value, "0");
+    bt_coal_us = atoi(value);
+    filter_property_get("vendor.wc_transport.coalesce_ant_us", value, "0");
+    ant_coal_us = atoi(value);
+    filter_property_get("vendor.wc_transport.coalesce_bytes", value, "1024");
+    coalesce_bytes = atoi(value);
+    if (coalesce_bytes == 0 || coalesce_bytes > COALESCE_MAX_BYTES)
+        coalesce_bytes = COALESCE_MAX_BYTES;
+
+    filter_property_get(UART_DEVICES_PROP, value, BT_HS_UART_DEVICE);
+    for (dev = strtok_r(value, ", ", &saveptr); dev != NULL;
+         dev = strtok_r(NULL, ", ", &saveptr)) {
+        if (num_instances == MAX_FILTER_INSTANCES) {
+            ALOGE("%s: only %d UARTs supported, ignoring %s", __func__,
+                  MAX_FILTER_INSTANCES, dev);
+            continue;
+        }
+        inst = &instances[num_instances];
+        inst->index = num_instances;
+        snprintf(inst->uart_dev, sizeof(inst->uart_dev), "%s", dev);
+        if (inst->index == 0) {
+            snprintf(inst->bt_sock, sizeof(inst->bt_sock), BT_SOCK);
+            snprintf(inst->ant_sock, sizeof(inst->ant_sock), ANT_SOCK);
+        } else {
+            snprintf(inst->bt_sock, sizeof(inst->bt_sock), BT_SOCK "%d", inst->index);
+            snprintf(inst->ant_sock, sizeof(inst->ant_sock), ANT_SOCK "%d", inst->index);
+        }
+        inst->bt_listen_fd = -1;
+        inst->ant_listen_fd = -1;
+        pthread_mutex_init(&inst->signal_mutex, NULL);
+        pthread_mutex_init(&inst->rsp_cache_mutex, NULL);
+        memcpy(inst->rsp_cache, rsp_cache_template, sizeof(inst->rsp_cache));
+        inst->uart_profile = &uart_profiles[0];
+        inst->bt_coal.budget_us = bt_coal_us > 0 ? bt_coal_us : 0;
+        inst->ant_coal.budget_us = ant_coal_us > 0 ? ant_coal_us : 0;
+        inst->acl_sched.enabled = acl_sched;
+        pthread_mutex_init(&inst->acl_sched.lock, NULL);
+        pthread_cond_init(&inst->acl_sched.cond, NULL);
+        if (inst->index == 0) {
+            snprintf(inst->diag.sock_name, sizeof(inst->diag.sock_name), DIAG_SOCK);
+            snprintf(inst->diag.path, sizeof(inst->diag.path), "%s", diag_path);
+        } else {
+            snprintf(inst->diag.sock_name, sizeof(inst->diag.sock_name), DIAG_SOCK "%d",
+                     inst->index);
+            snprintf(inst->diag.path, sizeof(inst->diag.path), "%s%d", diag_path,
+                     inst->index);
+        }
+        inst->diag.fd = -1;
+        pthread_mutex_init(&inst->diag.lock, NULL);
+        pthread_cond_init(&inst->diag.cond, NULL);
+        num_instances++;
+    }
+
+    /* A lone UART keeps the old behaviour, several are spread over the CPUs
+     * so one busy controller does not starve the others
+     */
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (i = 0; i < num_instances; i++) {
+        instances[i].cpu = (num_instances > 1 && ncpus > 1) ? i % ncpus : -1;
+        ALOGI("%s: %s on %s/%s, cpu %d", __func__, instances[i].uart_dev,
+              instances[i].bt_sock, instances[i].ant_sock, instances[i].cpu);
+    }
+    return num_instances;
+}
+
+static int handover_io(int fd, unsigned char *buf, size_t len, bool out)
+{
+    size_t done = 0;
     int ret;
-    ALOGV("%s: Entry", __func__);
-    signal(SIGPIPE, SIG_IGN);
 
-    pthread_mutex_init(&signal_mutex, NULL);
-    if (pthread_create(&bt_mon_thread, NULL, (void *)bt_thread, NULL) != 0) {
+    while (done < len) {
+        ret = out ? write(fd, buf + done, len - done) : read(fd, buf + done, len - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
+    }
+    return 0;
+}
+
+static bool shm_clients_attached()
+{
+    int i;
+
+    for (i = 0; i < num_instances; i++) {
+        if (instances[i].bt_shm != NULL || instances[i].ant_shm != NULL)
+            return true;
+    }
+    return false;
+}
+
+/* Gets every thread that reads or writes the UART or a client to its next
+ * packet boundary. Returns -1 if one of them did not make it in time.
+ */
+/* Threads of all instances still running, with handover.lock held */
+static int handover_live_threads()
+{
+    int n = 0, i;
+
+    for (i = 0; i < num_instances; i++)
+        n += __builtin_popcount(instances[i].threads_live);
+    return n;
+}
+
+static int handover_quiesce()
+{
+    struct filter_instance *inst;
+    struct timespec ts;
+    int64_t deadline = get_time_ms() + HANDOVER_QUIESCE_MS;
+    int expected, ret, i;
+
+    pthread_mutex_lock(&handover.lock);
+    handover_quiescing = true;
+    /* Threads that exited meanwhile are off the count, so recount each time */
+    while (handover.parked < (expected = handover_live_threads()) &&
+           get_time_ms() < deadline) {
+        /* Again and again: a thread may have checked the flag right before
+         * it was set and only then gone to sleep
+         */
+        for (i = 0; i < num_instances; i++) {
+            inst = &instances[i];
+            kick_live_threads_locked(inst);
+            if (inst->threads_live & INST_THREAD_ACL) {
+                pthread_mutex_lock(&inst->acl_sched.lock);
+                pthread_cond_broadcast(&inst->acl_sched.cond);
+                pthread_mutex_unlock(&inst->acl_sched.lock);
+            }
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += HANDOVER_KICK_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&handover.cond, &handover.lock, &ts);
+    }
+    ret = handover.parked == expected ? 0 : -1;
+    if (ret < 0)
+        ALOGE("%s: only %d of %d threads stopped", __func__, handover.parked, expected);
+    pthread_mutex_unlock(&handover.lock);
+    return ret;
+}
+
+static void handover_resume()
+{
+    pthread_mutex_lock(&handover.lock);
+    handover_quiescing = false;
+    pthread_cond_broadcast(&handover.cond);
+    pthread_mutex_unlock(&handover.lock);
+    ALOGI("%s: handover abandoned, carrying on", __func__);
+}
+
+/* Passes everything to the filter on sock: a struct handover_msg with the
+ * fds attached, then each instance's pending bytes. Returns 0 once the new
+ * filter confirmed it took over; the threads stay parked then and this
+ * process has to go.
+ */
+static int handover_send(int sock)
+{
+    struct handover_msg msg;
+    struct handover_inst *hi;
+    struct filter_instance *inst;
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * MAX_FILTER_INSTANCES * HANDOVER_FDS)];
+    } ctrl;
+    int fds[MAX_FILTER_INSTANCES * HANDOVER_FDS];
+    int inst_fds[HANDOVER_FDS];
+    unsigned char *acl[MAX_FILTER_INSTANCES] = { NULL };
+    int acl_len[MAX_FILTER_INSTANCES] = { 0 };
+    struct pollfd pfd;
+    int nfds = 0, ret = -1, i, k;
+    char ack;
+
+    /* A shared-memory ring lives on in the client, it cannot be moved */
+    if (shm_clients_attached()) {
+        ALOGE("%s: shared memory clients attached, refusing handover", __func__);
+        return -1;
+    }
+    if (handover_quiesce() < 0 || shm_clients_attached())
+        goto out;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.magic = HANDOVER_MAGIC;
+    msg.version = HANDOVER_VERSION;
+    msg.num_instances = num_instances;
+    for (i = 0; i < num_instances; i++) {
+        inst = &instances[i];
+        hi = &msg.inst[i];
+
+        /* Nothing is left held back for the clients */
+        io_set_write_lock(&inst->signal_mutex);
+        pthread_mutex_lock(&inst->signal_mutex);
+        coalesce_flush(inst, inst->remote_bt_fd, &inst->bt_coal);
+        coalesce_flush(inst, inst->remote_ant_fd, &inst->ant_coal);
+        pthread_mutex_unlock(&inst->signal_mutex);
+        acl_len[i] = acl_sched_snapshot(inst, &acl[i]);
+        if (acl_len[i] < 0)
+            goto out;
+
+        snprintf(hi->uart_dev, sizeof(hi->uart_dev), "%s", inst->uart_dev);
+        snprintf(hi->uart_profile, sizeof(hi->uart_profile), "%s", inst->uart_profile->name);
+        hi->recovery_requested = inst->wdog.recovery_requested;
+        hi->vendor_cmd = inst->wdog.vendor_cmd;
+        hi->cmd_sent_ms = inst->wdog.cmd_sent_ms;
+        hi->pending[HANDOVER_UART] = inst->ho_pending_len[HANDOVER_UART];
+        hi->pending[HANDOVER_BT] = acl_len[i] + inst->ho_pending_len[HANDOVER_BT];
+        hi->pending[HANDOVER_ANT] = inst->ho_pending_len[HANDOVER_ANT];
+
+        inst_fds[HANDOVER_UART] = inst->fd_transport;
+        inst_fds[HANDOVER_BT] = inst->remote_bt_fd;
+        inst_fds[HANDOVER_ANT] = inst->remote_ant_fd;
+        inst_fds[HANDOVER_BT_LISTEN] = inst->bt_listen_fd;
+        inst_fds[HANDOVER_ANT_LISTEN] = inst->ant_listen_fd;
+        for (k = 0; k < HANDOVER_FDS; k++) {
+            hi->fd[k] = inst_fds[k] > 0 ? nfds : -1;
+            if (inst_fds[k] > 0)
+                fds[nfds++] = inst_fds[k];
+        }
+    }
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof(msg);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (nfds > 0) {
+        mh.msg_control = ctrl.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+    if (sendmsg(sock, &mh, 0) != sizeof(msg)) {
+        ALOGE("%s: unable to send handover: %s", __func__, strerror(errno));
+        goto out;
+    }
+    for (i = 0; i < num_instances; i++) {
+        inst = &instances[i];
+        if (handover_io(sock, inst->ho_pending[HANDOVER_UART],
+                        inst->ho_pending_len[HANDOVER_UART], true) < 0 ||
+            handover_io(sock, acl[i], acl_len[i], true) < 0 ||
+            handover_io(sock, inst->ho_pending[HANDOVER_BT],
+                        inst->ho_pending_len[HANDOVER_BT], true) < 0 ||
+            handover_io(sock, inst->ho_pending[HANDOVER_ANT],
+                        inst->ho_pending_len[HANDOVER_ANT], true) < 0) {
+            ALOGE("%s: unable to send pending bytes: %s", __func__, strerror(errno));
+            goto out;
+        }
+    }
+
+    /* Until the new filter answers, the UARTs are still ours */
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, HANDOVER_QUIESCE_MS) == 1 && read(sock, &ack, 1) == 1)
+        ret = 0;
+    else
+        ALOGE("%s: new filter did not confirm", __func__);
+
+out:
+    for (i = 0; i < num_instances; i++)
+        free(acl[i]);
+    if (ret < 0)
+        handover_resume();
+    return ret;
+}
+
+static int handover_thread_fn()
+{
+    int listen_fd = -1, fd;
+
+    ALOGV("%s: Entry ", __func__);
+    do {
+        fd = establish_remote_socket(HANDOVER_SOCK, &listen_fd);
+        if (fd < 0) {
+            sleep(1);
+            continue;
+        }
+        ALOGI("%s: new filter connected, handing over", __func__);
+        if (handover_send(fd) == 0) {
+            /* The hci_filter_status/start_hci handshake carries on with it */
+            ALOGI("%s: handed over, exiting", __func__);
+            hci_record_close();
+            _exit(0);
+        }
+        close(fd);
+    } while (1);
+
+    pthread_exit(NULL);
+    return 0;
+}
+
+/* Takes the UARTs and their clients over from a filter already running.
+ * Returns 1 if it did, 0 if there was none to take over from and -1 if the
+ * handover failed; the running filter keeps everything then.
+ */
+static int handover_receive()
+{
+    struct handover_msg msg;
+    struct handover_inst *hi;
+    struct filter_instance *inst;
+    const struct uart_profile *prof;
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * MAX_FILTER_INSTANCES * HANDOVER_FDS)];
+    } ctrl;
+    int fds[MAX_FILTER_INSTANCES * HANDOVER_FDS];
+    bool adopted[MAX_FILTER_INSTANCES * HANDOVER_FDS];
+    unsigned char *pending[MAX_FILTER_INSTANCES][HANDOVER_STREAMS];
+    /* instance taking over each handed over one, NULL if none does */
+    struct filter_instance *target[MAX_FILTER_INSTANCES];
+    int inst_fds[HANDOVER_FDS];
+    int sock, nfds = 0, ret = -1, i, j, k;
+    char ack = 1;
+
+    sock = socket_local_client(HANDOVER_SOCK, ANDROID_SOCKET_NAMESPACE_ABSTRACT,
+                               SOCK_STREAM);
+    if (sock < 0) {
+        ALOGI("%s: no running filter to take over from", __func__);
+        return 0;
+    }
+
+    memset(pending, 0, sizeof(pending));
+    memset(target, 0, sizeof(target));
+    memset(adopted, 0, sizeof(adopted));
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof(msg);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctrl.buf;
+    mh.msg_controllen = sizeof(ctrl.buf);
+    if (recvmsg(sock, &mh, MSG_WAITALL) != sizeof(msg)) {
+        ALOGE("%s: running filter refused the handover", __func__);
+        goto out;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+        }
+    }
+    if (msg.magic != HANDOVER_MAGIC || msg.version != HANDOVER_VERSION ||
+        msg.num_instances > MAX_FILTER_INSTANCES || (mh.msg_flags & MSG_CTRUNC)) {
+        ALOGE("%s: handover message not understood", __func__);
+        goto out;
+    }
+
+    for (i = 0; i < msg.num_instances; i++) {
+        hi = &msg.inst[i];
+        for (k = 0; k < HANDOVER_FDS; k++) {
+            if (hi->fd[k] >= nfds) {
+                ALOGE("%s: handover message not understood", __func__);
+                goto out;
+            }
+        }
+        for (k = 0; k < HANDOVER_STREAMS; k++) {
+            if (hi->pending[k] == 0)
+                continue;
+            pending[i][k] = malloc(hi->pending[k]);
+            if (pending[i][k] == NULL ||
+                handover_io(sock, pending[i][k], hi->pending[k], false) < 0) {
+                ALOGE("%s: unable to take pending bytes", __func__);
+                goto out;
+            }
+        }
+    }
+
+    /* Pending bytes are primed before confirming: once the old filter has
+     * the ack it is gone, and a partial packet with it
+     */
+    for (i = 0; i < msg.num_instances; i++) {
+        hi = &msg.inst[i];
+        hi->uart_dev[sizeof(hi->uart_dev) - 1] = '\0';
+        hi->uart_profile[sizeof(hi->uart_profile) - 1] = '\0';
+        if (hi->fd[HANDOVER_UART] < 0)
+            continue;
+        for (j = 0; j < num_instances; j++) {
+            if (!strcmp(instances[j].uart_dev, hi->uart_dev))
+                target[i] = &instances[j];
+        }
+        if (target[i] == NULL)
+            continue;
+        for (k = 0; k < HANDOVER_STREAMS; k++) {
+            if (hi->pending[k] > 0 && hi->fd[k] >= 0 &&
+                io_prime_read(fds[hi->fd[k]], pending[i][k], hi->pending[k]) < 0) {
+                ALOGE("%s: unable to keep pending bytes of %s", __func__, hi->uart_dev);
+                goto unprime;
+            }
+        }
+    }
+
+    if (handover_io(sock, (unsigned char *)&ack, 1, true) < 0) {
+        ALOGE("%s: unable to confirm: %s", __func__, strerror(errno));
+        goto unprime;
+    }
+    ret = 1;
+
+    for (i = 0; i < msg.num_instances; i++) {
+        hi = &msg.inst[i];
+        inst = target[i];
+        if (inst == NULL) {
+            /* No longer configured, its clients see the filter go away */
+            ALOGI("%s: %s is not served any more", __func__, hi->uart_dev);
+            continue;
+        }
+        for (k = 0; k < HANDOVER_FDS; k++)
+            inst_fds[k] = hi->fd[k] >= 0 ? fds[hi->fd[k]] : -1;
+
+        for (k = 0; k < HANDOVER_FDS; k++) {
+            if (hi->fd[k] >= 0)
+                adopted[(int)hi->fd[k]] = true;
+        }
+        inst->fd_transport = inst_fds[HANDOVER_UART];
+        inst->remote_bt_fd = inst_fds[HANDOVER_BT] > 0 ? inst_fds[HANDOVER_BT] : 0;
+        inst->remote_ant_fd = inst_fds[HANDOVER_ANT] > 0 ? inst_fds[HANDOVER_ANT] : 0;
+        inst->bt_listen_fd = inst_fds[HANDOVER_BT_LISTEN];
+        inst->ant_listen_fd = inst_fds[HANDOVER_ANT_LISTEN];
+        inst->wdog.recovery_requested = hi->recovery_requested;
+        inst->wdog.vendor_cmd = hi->vendor_cmd;
+        /* CLOCK_MONOTONIC is the same for both processes */
+        inst->wdog.cmd_sent_ms = hi->cmd_sent_ms;
+
+        prof = find_uart_profile(hi->uart_profile);
+        if (prof != NULL && prof != &uart_profiles[0])
+            apply_uart_profile(inst, inst->fd_transport, prof);
+        ALOGI("%s: took over %s: bt client %d, ant client %d, %u/%u/%u pending bytes",
+              __func__, inst->uart_dev, inst->remote_bt_fd, inst->remote_ant_fd,
+              hi->pending[HANDOVER_UART], hi->pending[HANDOVER_BT],
+              hi->pending[HANDOVER_ANT]);
+    }
+    goto out;
+
+unprime:
+    for (i = 0; i < msg.num_instances; i++) {
+        for (k = 0; target[i] != NULL && k < HANDOVER_STREAMS; k++) {
+            unsigned char *primed;
+
+            if (msg.inst[i].fd[k] >= 0 &&
+                io_detach_read(fds[(int)msg.inst[i].fd[k]], &primed) > 0)
+                free(primed);
+        }
+    }
+out:
+    for (i = 0; i < nfds; i++) {
+        if (!adopted[i])
+            close(fds[i]);
+    }
+    for (i = 0; i < MAX_FILTER_INSTANCES; i++) {
+        for (k = 0; k < HANDOVER_STREAMS; k++)
+            free(pending[i][k]);
+    }
+    close(sock);
+    return ret;
+}
+
+/* Creates one of the threads of inst, counted as running right away */
+static int start_instance_thread(struct filter_instance *inst, unsigned int thread,
+                                 pthread_t *tid, int (*fn)(struct filter_instance *))
+{
+    pthread_mutex_lock(&handover.lock);
+    inst->threads_live |= thread;
+    pthread_mutex_unlock(&handover.lock);
+    if (pthread_create(tid, NULL, (void *)fn, inst) != 0) {
+        instance_thread_exit(inst, thread);
+        return -1;
+    }
+    return 0;
+}
+
+static int start_instance(struct filter_instance *inst)
+{
+    /* Reader first: the client threads may signal it right away */
+    if (start_instance_thread(inst, INST_THREAD_READER, &inst->reader_thread,
+                              start_reader_thread) != 0) {
+        perror("pthread_create for reader");
+        return -1;
+    }
+
+    /* In library mode the stack itself is this instance's BT client */
+    if (inst->bt_cb.bt_recv == NULL &&
+        start_instance_thread(inst, INST_THREAD_BT, &inst->bt_mon_thread, bt_thread) != 0) {
         perror("pthread_create for bt_monitor");
-        ret = -1;
-        goto bt_thread_fail;
+        return -1;
     }
 
-    if (pthread_create(&ant_mon_thread, NULL, (void *)ant_thread, NULL) != 0) {
+    if (start_instance_thread(inst, INST_THREAD_ANT, &inst->ant_mon_thread, ant_thread) != 0) {
         perror("pthread_create for ant_monitor");
-        ret = -1;
-        goto ant_thread_fail;
+        return -1;
     }
 
-    /*Main thread monitors on UART data/events*/
-    ret = start_reader_thread();
+    if (inst->acl_sched.enabled &&
+        start_instance_thread(inst, INST_THREAD_ACL, &inst->acl_sched.thread,
+                              acl_sched_thread) != 0) {
+        ALOGE("%s: unable to start ACL scheduler, sending in order", __func__);
+        inst->acl_sched.enabled = false;
+    }
 
-    if (ret < 0) {
-        ALOGE("%s: start_reader_thread returns: %d", __func__, ret);
+    if (diag_mode != DIAG_OFF &&
+        pthread_create(&inst->diag.thread, NULL, (void *)diag_thread, inst) != 0) {
+        ALOGE("%s: unable to start diagnostics, events are dropped", __func__);
+    }
+    return 0;
+}
+
+/* First real-time signal nobody in the process handles, -1 if none is */
+static int find_free_signal()
+{
+    struct sigaction sa;
+    int sig;
+
+    for (sig = SIGRTMIN; sig <= SIGRTMAX; sig++) {
+        if (sigaction(sig, NULL, &sa) == 0 && !(sa.sa_flags & SA_SIGINFO) &&
+            sa.sa_handler == SIG_DFL)
+            return sig;
+    }
+    return -1;
+}
+
+/* Brings all instances up, attaching bt_cb (library mode) to the first one */
+static int filter_start(const struct wcnss_filter_callbacks *bt_cb, void *bt_cb_ctx)
+{
+    struct sigaction sa;
+    sigset_t mask, caller_mask;
+    char value[PROPERTY_VALUE_MAX] = {'\0'};
+    int i, ret = 0;
+
+    /* The stack's process keeps its own SIGPIPE, our threads block it */
+    if (!library_mode)
+        signal(SIGPIPE, SIG_IGN);
+    else if ((wdog_signal = find_free_signal()) < 0) {
+        ALOGE("%s: no free signal to kick threads with", __func__);
+        return -1;
+    }
+
+    /* No SA_RESTART: the watchdog relies on blocking calls failing with EINTR */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wdog_sig_handler;
+    sigaction(wdog_signal, &sa, NULL);
+
+    filter_property_get("vendor.wc_transport.io_backend", value, "select");
+    io_backend_init(value);
+    filter_property_get("vendor.wc_transport.stats_interval_ms", value, "0");
+    stats_interval_ms = atoi(value);
+    filter_property_get("vendor.wc_transport.zero_copy", value, "0");
+    zero_copy_enabled = !strcmp(value, "1") || !strcmp(value, "true");
+    filter_property_get("vendor.wc_transport.rsp_cache", value, "1");
+    rsp_cache_enabled = !strcmp(value, "1") || !strcmp(value, "true");
+    filter_property_get("vendor.wc_transport.shm_ring", value, "0");
+    shm_ring_enabled = !strcmp(value, "1") || !strcmp(value, "true");
+    check_pkt_hooks();
+    /* Handing over needs a process of our own */
+    filter_property_get("vendor.wc_transport.handover", value, "0");
+    handover_enabled = !library_mode && (!strcmp(value, "1") || !strcmp(value, "true"));
+    filter_property_get("vendor.wc_transport.record_path", value, "");
+    if (value[0] != '\0') {
+        char max_kb[PROPERTY_VALUE_MAX] = {'\0'};
+
+        filter_property_get("vendor.wc_transport.record_max_kb", max_kb, "");
+        if (hci_record_open(value, (max_kb[0] ? (size_t)atol(max_kb) :
+                                    RECORD_MAX_KB_DEFAULT) * 1024) == 0)
+            io_set_rx_tap(record_rx);
+        else
+            ALOGE("%s: unable to record to %s: %s", __func__, value, strerror(errno));
+    }
+
+    if (setup_instances() == 0) {
+        ALOGE("%s: no UART to serve", __func__);
+        return -1;
+    }
+
+    /* The stack hears about a UART that does not come up from
+     * wcnss_filter_start() rather than from a reader thread later on
+     */
+    for (i = 0; library_mode && i < num_instances; i++) {
+        if (init_transport(&instances[i]) < 0) {
+            ALOGE("%s: unable to initialize transport %s", __func__, instances[i].uart_dev);
+            while (i >= 0) {
+                if (instances[i].fd_transport > 0)
+                    close(instances[i].fd_transport);
+                instances[i--].fd_transport = 0;
+            }
+            num_instances = 0;
+            return -1;
+        }
+    }
+
+    if (bt_cb != NULL) {
+        instances[0].bt_cb = *bt_cb;
+        instances[0].bt_cb_ctx = bt_cb_ctx;
+        instances[0].bt_cb_on = true;
+    }
+
+    /* A filter already running keeps the UARTs if taking them over fails */
+    if (handover_enabled && handover_receive() < 0)
+        exit(1);
+
+    /* Threads inherit the mask of the caller, which may well block our
+     * signal in library mode
+     */
+    pthread_sigmask(SIG_SETMASK, NULL, &mask);
+    sigdelset(&mask, wdog_signal);
+    if (library_mode)
+        sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_SETMASK, &mask, &caller_mask);
+
+    for (i = 0; i < num_instances; i++) {
+        if (start_instance(&instances[i]) < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    if (pthread_create(&wdog_thread, NULL, (void *)wdog_thread_fn, NULL) != 0) {
+        ALOGE("%s: unable to start watchdog, stall recovery disabled", __func__);
     }
 
-ant_thread_fail:
-    cleanup_thread(ant_mon_thread);
-bt_thread_fail:
-    cleanup_thread(bt_mon_thread);
+    if (handover_enabled &&
+        pthread_create(&handover.thread, NULL, (void *)handover_thread_fn, NULL) != 0) {
+        ALOGE("%s: unable to start handover thread", __func__);
+    }
+out:
+    pthread_sigmask(SIG_SETMASK, &caller_mask, NULL);
+    return ret;
+}
 
-    pthread_mutex_destroy(&signal_mutex);
+#ifndef WCNSS_FILTER_LIB
+int main(int argc, char **argv) {
+    int ret = 0, i, opt;
+    char *eq;
+    ALOGV("%s: Entry", __func__);
 
+    while ((opt = getopt(argc, argv, "p:")) != -1) {
+        eq = opt == 'p' ? strchr(optarg, '=') : NULL;
+        if (eq == NULL || num_prop_overrides == MAX_PROP_OVERRIDES) {
+            fprintf(stderr, "usage: %s [-p name=value]...\n", argv[0]);
+            return -1;
+        }
+        *eq = '\0';
+        prop_overrides[num_prop_overrides].name = optarg;
+        prop_overrides[num_prop_overrides].value = eq + 1;
+        num_prop_overrides++;
+    }
+
+    if (filter_start(NULL, NULL) < 0) {
+        ret = -1;
+        goto exit;
+    }
+
+    /*Reader threads monitor on UART data/events*/
+    for (i = 0; i < num_instances; i++) {
+        cleanup_thread(instances[i].reader_thread);
+        if (instances[i].reader_ret < 0) {
+            ALOGE("%s: %s reader returns: %d", __func__, instances[i].uart_dev,
+                  instances[i].reader_ret);
+            ret = -1;
+        }
+    }
+
+    for (i = 0; i < num_instances; i++) {
+        cleanup_thread(instances[i].ant_mon_thread);
+        cleanup_thread(instances[i].bt_mon_thread);
+        pthread_mutex_destroy(&instances[i].signal_mutex);
+    }
+
+exit:
     ALOGV("%s: Exit: %d", __func__, ret);
-    property_set("vendor.wc_transport.hci_filter_status", "0");
-    property_set("vendor.wc_transport.start_hci", "false");
+    hci_record_close();
+    filter_property_set("vendor.wc_transport.hci_filter_status", "0");
+    filter_property_set("vendor.wc_transport.start_hci", "false");
     return ret;
 }
+#endif //WCNSS_FILTER_LIB
+
+static bool any_client_connected()
+{
+    int i;
+
+    for (i = 0; i < num_instances; i++) {
+        if (instances[i].remote_bt_fd || instances[i].remote_ant_fd)
+            return true;
+    }
+    return false;
+}
 
 static void handle_cleanup()
 {
@@ -941,35 +3997,128 @@ static void handle_cleanup()
     char cleanup[PROPERTY_VALUE_MAX];
     int ref_val,clean;
 
+    /* The stack's process is not ours to end, nor is the service handshake */
+    if (library_mode)
+        return;
+
     ALOGE("wcnss_filter client is terminated");
-    property_get("vendor.wc_transport.clean_up", cleanup, "0");
+    filter_property_get("vendor.wc_transport.clean_up", cleanup, "0");
     clean = atoi(cleanup);
     ALOGE("clean Value =  %d",clean);
-    property_get("vendor.wc_transport.ref_count", ref_count, "0");
+    filter_property_get("vendor.wc_transport.ref_count", ref_count, "0");
     ref_val = atoi(ref_count);
     if(clean == 0) {
       if(ref_val > 0)
       {
          ref_val--;
          snprintf(ref_count, 3, "%d", ref_val);
-         property_set("vendor.wc_transport.ref_count", ref_count);
+         filter_property_set("vendor.wc_transport.ref_count", ref_count);
       }
     }
-    if (!remote_bt_fd && !remote_ant_fd) {
+    if (!any_client_connected()) {
         char value[PROPERTY_VALUE_MAX] = {'\0'};
 
         ALOGD("%s",__func__);
 
-        property_get("vendor.wc_transport.hci_filter_status", value, "0");
+        filter_property_get("vendor.wc_transport.hci_filter_status", value, "0");
         if (!strcmp(value, "0")) {
             ALOGI("%s: wcnss_filter has been stopped already", __func__);
             return;
         } else
-            property_set("vendor.wc_transport.hci_filter_status", "0");
+            filter_property_set("vendor.wc_transport.hci_filter_status", "0");
 
         //property_set("vendor.wc_transport.soc_initialized", "0");
-        property_set("vendor.wc_transport.start_hci", "false");
+        filter_property_set("vendor.wc_transport.start_hci", "false");
         ALOGE("Done with this Life!!!");
+        hci_record_close();
         exit(0);
     }
 }
+
+#ifdef WCNSS_FILTER_LIB
+static pthread_mutex_t lib_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool lib_started;
+
+int wcnss_filter_start(const struct wcnss_filter_callbacks *cb, void *ctx)
+{
+    struct filter_instance *inst = &instances[0];
+    int ret = 0;
+
+    if (cb == NULL || cb->bt_recv == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&lib_mutex);
+    if (!lib_started) {
+        library_mode = true;
+        ret = filter_start(cb, ctx);
+        lib_started = ret == 0;
+    } else if (inst->bt_cb_on) {
+        errno = EBUSY;
+        ret = -1;
+    } else if (inst->uart_dead) {
+        errno = EIO;
+        ret = -1;
+    } else {
+        inst->bt_cb = *cb;
+        inst->bt_cb_ctx = ctx;
+        __atomic_store_n(&inst->bt_cb_on, true, __ATOMIC_SEQ_CST);
+        ALOGI("%s: BT client attached", __func__);
+    }
+    pthread_mutex_unlock(&lib_mutex);
+    return ret;
+}
+
+int wcnss_filter_send_bt(const unsigned char *buf, int len)
+{
+    struct filter_instance *inst = &instances[0];
+    /* forward_bt_packet() only reads it */
+    unsigned char *pkt = (unsigned char *)buf;
+
+    if (!__atomic_load_n(&inst->bt_cb_on, __ATOMIC_ACQUIRE)) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (inst->uart_dead) {
+        errno = EIO;
+        return -1;
+    }
+    if (len < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The stack's thread stands in for the BT client thread */
+    io_set_write_lock(&inst->signal_mutex);
+    hci_record(HCI_REC_HOST_RX, inst->index, HCI_REC_CHAN_BT, HCI_REC_HOST_TO_SOC, buf, len);
+
+    if (len == 1 && buf[0] == BT_SSR_TRIGGERED) {
+        wdog_request_recovery(inst, "SSR triggered by host");
+        return len;
+    }
+    if ((buf[0] != BT_CMD_PACKET_TYPE && buf[0] != BT_ACL_PACKET_TYPE &&
+         buf[0] != BT_SCO_PACKET_TYPE) || host_packet_len(pkt, len) != len) {
+        ALOGE("%s: dropping malformed packet (type %x, %d bytes)", __func__, buf[0], len);
+        errno = EINVAL;
+        return -1;
+    }
+    return forward_bt_packet(inst, 0, inst->fd_transport, pkt, len, HOST_TO_SOC);
+}
+
+void wcnss_filter_stop()
+{
+    struct filter_instance *inst = &instances[0];
+
+    pthread_mutex_lock(&lib_mutex);
+    if (lib_started && inst->bt_cb_on) {
+        __atomic_store_n(&inst->bt_cb_on, false, __ATOMIC_SEQ_CST);
+        /* A delivery may be running on the reader thread, let it finish */
+        while (!in_bt_cb && __atomic_load_n(&inst->bt_cb_busy, __ATOMIC_SEQ_CST) > 0)
+            sched_yield();
+        acl_sched_drop(inst);
+        ALOGI("%s: BT client detached", __func__);
+    }
+    pthread_mutex_unlock(&lib_mutex);
+}
+#endif //WCNSS_FILTER_LIB
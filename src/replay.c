@@ -0,0 +1,657 @@
+/*==========================================================================
+Description
+  wcnss_replay: plays a session recorded by wcnss_filter
+  (vendor.wc_transport.record_path) back into a filter and reports how fast
+  it forwarded compared to the original.
+
+  usage: wcnss_replay [-f] [-i instance] [-p name=value]... recording
+                      [filter_binary]
+
+  The filter is started on the slave side of a pseudo-terminal, standing in
+  for the controller. The replayer connects as the BT (and, if the session
+  had ANT traffic, ANT) client. It writes every UART_RX/HOST_RX record to the
+  pty or the matching socket, at the original offsets or, with -f, as fast as
+  the filter takes them. Whatever comes out of the filter is matched against
+  the recording's PACKET records. A packet's latency runs from the moment the
+  chunk that completed it was written until it arrives.
+
+  The replay is open loop: nothing answers the filter beyond what the
+  recording holds. The filter's response cache is therefore turned off, so
+  every recorded command really reaches the pty. The filter gets all of its
+  vendor.wc_transport.* settings that matter on the command line (-p), with
+  handover, hooks, diagnostics and the tuning knobs at their defaults; -p
+  options given to wcnss_replay are passed on after them and win. The system
+  properties are left alone. A filter already serving bt_sock would take the
+  replay's connections, wcnss_replay refuses to run next to one. It needs to
+  run as root or bluetooth to be let in as a client.
+
+  Exits with 0 when every recorded packet came out and nothing else did.
+
+===========================================================================*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <cutils/sockets.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hci_record.h"
+#include "shm_ring.h"
+
+#define DEFAULT_FILTER      "/vendor/bin/wcnss_filter"
+#define REPLAY_MAX_PROPS    16
+
+#define REPLAY_MAX_DATA     (128 * 1024)
+#define REPLAY_CONNECT_MS   5000
+/* Output is given this long to catch up once everything was written */
+#define REPLAY_DRAIN_MS     2000
+/* How many packets of one source may be lost before we stop looking */
+#define REPLAY_RESYNC       16
+
+enum {
+    OUT_UART = 0,
+    OUT_BT,
+    OUT_ANT,
+    NUM_OUT,
+};
+
+struct replay_event {
+    struct hci_rec_hdr hdr;
+    unsigned char *data;
+    /* packets: the rx event that completed it, -1 if none was recorded */
+    int src;
+    /* rx events: when we wrote it, 0 until then */
+    int64_t inject_us;
+};
+
+/* The packets of one output that came in from one source. The filter keeps
+ * those in order, packets of different sources (BT and ANT towards the UART)
+ * may interleave differently than they did in the recording.
+ */
+struct lane {
+    int *expected;      /* indexes into events[] */
+    int nexp;
+    int next;           /* first one not seen yet */
+};
+
+struct out_stream {
+    const char *name;
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+
+    /* indexes into events[], in recorded order */
+    int *expected;
+    int nexp;
+    struct lane lanes[3];
+
+    unsigned char buf[2 * REPLAY_MAX_DATA];
+    size_t buf_len;
+
+    int matched;
+    uint64_t unexpected;
+    uint64_t bytes;
+    int64_t first_us, last_us;
+    uint32_t *lat_us;
+};
+
+static struct replay_event *events;
+static int num_events;
+static struct out_stream outs[NUM_OUT] = {
+    [OUT_UART] = { .name = "host->soc" },
+    [OUT_BT]   = { .name = "soc->bt" },
+    [OUT_ANT]  = { .name = "soc->ant" },
+};
+
+static int64_t now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until_us(int64_t t)
+{
+    struct timespec ts;
+
+    ts.tv_sec = t / 1000000;
+    ts.tv_nsec = (t % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int out_of(const struct hci_rec_hdr *hdr)
+{
+    if (hdr->dir == HCI_REC_HOST_TO_SOC)
+        return OUT_UART;
+    return hdr->chan == HCI_REC_CHAN_ANT ? OUT_ANT : OUT_BT;
+}
+
+/* rx stream a packet's bytes came in on: the UART or one client */
+static int rx_of(const struct hci_rec_hdr *hdr)
+{
+    if (hdr->dir == HCI_REC_SOC_TO_HOST)
+        return HCI_REC_CHAN_UART;
+    return hdr->chan;
+}
+
+static int load_recording(const char *path, int instance)
+{
+    struct hci_rec_file_hdr fh;
+    struct hci_rec_hdr hdr;
+    struct replay_event *ev;
+    struct out_stream *st;
+    struct lane *lane;
+    unsigned char *buf;
+    int last_rx[3] = { -1, -1, -1 };
+    int cap = 0, ret, i, l;
+    FILE *f;
+
+    f = fopen(path, "re");
+    if (f == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (hci_record_read_header(f, &fh) < 0) {
+        fprintf(stderr, "%s: not a wcnss_filter recording\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    buf = malloc(REPLAY_MAX_DATA);
+    if (buf == NULL) {
+        fclose(f);
+        return -1;
+    }
+    while ((ret = hci_record_read(f, &hdr, buf, REPLAY_MAX_DATA)) > 0) {
+        if (hdr.instance != instance || hdr.chan > HCI_REC_CHAN_ANT)
+            continue;
+        if (num_events == cap) {
+            cap = cap ? cap * 2 : 1024;
+            ev = realloc(events, cap * sizeof(*ev));
+            if (ev == NULL)
+                break;
+            events = ev;
+        }
+        ev = &events[num_events];
+        memset(ev, 0, sizeof(*ev));
+        ev->hdr = hdr;
+        ev->src = -1;
+        ev->data = malloc(hdr.len);
+        if (ev->data == NULL)
+            break;
+        memcpy(ev->data, buf, hdr.len);
+
+        if (hdr.type == HCI_REC_PACKET)
+            ev->src = last_rx[rx_of(&hdr)];
+        else
+            last_rx[hdr.chan] = num_events;
+        num_events++;
+    }
+    free(buf);
+    fclose(f);
+    if (ret < 0)
+        fprintf(stderr, "%s: truncated, replaying the first %d records\n", path, num_events);
+
+    for (i = 0; i < num_events; i++) {
+        if (events[i].hdr.type == HCI_REC_PACKET) {
+            st = &outs[out_of(&events[i].hdr)];
+            st->nexp++;
+            st->lanes[rx_of(&events[i].hdr)].nexp++;
+        }
+    }
+    for (i = 0; i < NUM_OUT; i++) {
+        st = &outs[i];
+        st->expected = calloc(st->nexp + 1, sizeof(int));
+        st->lat_us = calloc(st->nexp + 1, sizeof(uint32_t));
+        if (st->expected == NULL || st->lat_us == NULL)
+            return -1;
+        st->nexp = 0;
+        for (l = 0; l < 3; l++) {
+            st->lanes[l].expected = calloc(st->lanes[l].nexp + 1, sizeof(int));
+            if (st->lanes[l].expected == NULL)
+                return -1;
+            st->lanes[l].nexp = 0;
+        }
+        st->fd = -1;
+        pthread_mutex_init(&st->lock, NULL);
+    }
+    for (i = 0; i < num_events; i++) {
+        if (events[i].hdr.type == HCI_REC_PACKET) {
+            st = &outs[out_of(&events[i].hdr)];
+            lane = &st->lanes[rx_of(&events[i].hdr)];
+            st->expected[st->nexp++] = i;
+            lane->expected[lane->nexp++] = i;
+        }
+    }
+    return num_events;
+}
+
+/* Position in lane of the first packet from..to that st->buf could start
+ * with, -1 if none
+ */
+static int lane_find(struct out_stream *st, struct lane *lane, int from, int to)
+{
+    struct replay_event *ev;
+    size_t n;
+    int j;
+
+    if (to > lane->nexp)
+        to = lane->nexp;
+    for (j = from; j < to; j++) {
+        ev = &events[lane->expected[j]];
+        n = ev->hdr.len < st->buf_len ? ev->hdr.len : st->buf_len;
+        if (!memcmp(st->buf, ev->data, n))
+            return j;
+    }
+    return -1;
+}
+
+/* Consumes every complete expected packet at the head of st->buf */
+static void match_output(struct out_stream *st, int64_t now)
+{
+    struct replay_event *ev;
+    struct lane *lane = NULL;
+    int64_t inject_us;
+    int j = -1, l;
+
+    while (st->buf_len > 0) {
+        /* The next packet of some source, else one after a few were lost */
+        for (l = 0; l < 3 && j < 0; l++) {
+            lane = &st->lanes[l];
+            j = lane_find(st, lane, lane->next, lane->next + 1);
+        }
+        for (l = 0; l < 3 && j < 0; l++) {
+            lane = &st->lanes[l];
+            j = lane_find(st, lane, lane->next + 1, lane->next + REPLAY_RESYNC);
+        }
+        if (j < 0) {
+            /* Nothing we expect starts here */
+            st->unexpected++;
+            memmove(st->buf, st->buf + 1, --st->buf_len);
+            continue;
+        }
+        ev = &events[lane->expected[j]];
+        if (st->buf_len < ev->hdr.len)
+            return;
+
+        lane->next = j + 1;
+        j = -1;
+        inject_us = ev->src >= 0 ?
+                    __atomic_load_n(&events[ev->src].inject_us, __ATOMIC_ACQUIRE) : 0;
+        if (inject_us) {
+            st->lat_us[st->matched] = now - inject_us;
+            if (st->first_us == 0 || inject_us < st->first_us)
+                st->first_us = inject_us;
+        }
+        st->last_us = now;
+        st->matched++;
+        st->bytes += ev->hdr.len;
+        st->buf_len -= ev->hdr.len;
+        memmove(st->buf, st->buf + ev->hdr.len, st->buf_len);
+    }
+}
+
+static void *out_thread(void *arg)
+{
+    struct out_stream *st = arg;
+    int ret;
+
+    do {
+        ret = read(st->fd, st->buf + st->buf_len, sizeof(st->buf) - st->buf_len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        pthread_mutex_lock(&st->lock);
+        st->buf_len += ret;
+        match_output(st, now_us());
+        pthread_mutex_unlock(&st->lock);
+    } while (1);
+    return NULL;
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+    size_t off = 0;
+    int ret;
+
+    while (off < len) {
+        ret = write(fd, buf + off, len - off);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += ret;
+    }
+    return 0;
+}
+
+static int connect_client(const char *name)
+{
+    int64_t deadline = now_us() + REPLAY_CONNECT_MS * 1000LL;
+    int fd;
+
+    do {
+        fd = socket_local_client(name, ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM);
+        if (fd >= 0)
+            return fd;
+        usleep(50 * 1000);
+    } while (now_us() < deadline);
+    fprintf(stderr, "unable to connect to %s\n", name);
+    return -1;
+}
+
+static int open_pty(char *slave, size_t len)
+{
+    struct termios term;
+    int fd;
+
+    fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0 ||
+        ptsname_r(fd, slave, len) != 0) {
+        fprintf(stderr, "unable to open a pty: %s\n", strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (tcgetattr(fd, &term) == 0) {
+        cfmakeraw(&term);
+        tcsetattr(fd, TCSANOW, &term);
+    }
+    return fd;
+}
+
+static void inject(bool fast, int *in_fds)
+{
+    struct replay_event *ev;
+    int64_t start = 0, first_ts = -1;
+    int i;
+
+    for (i = 0; i < num_events; i++) {
+        ev = &events[i];
+        if (ev->hdr.type == HCI_REC_PACKET)
+            continue;
+        /* The filter would answer with fds we cannot use, stay on the socket */
+        if (ev->hdr.type == HCI_REC_HOST_RX && ev->hdr.len == 1 &&
+            ev->data[0] == SHM_RING_REQUEST)
+            continue;
+        if (in_fds[ev->hdr.chan] < 0)
+            continue;
+
+        if (first_ts < 0) {
+            first_ts = ev->hdr.ts_us;
+            start = now_us();
+        }
+        if (!fast)
+            sleep_until_us(start + (int64_t)(ev->hdr.ts_us - first_ts));
+
+        __atomic_store_n(&ev->inject_us, now_us(), __ATOMIC_RELEASE);
+        if (write_all(in_fds[ev->hdr.chan], ev->data, ev->hdr.len) < 0) {
+            fprintf(stderr, "replay stopped at record %d: %s\n", i, strerror(errno));
+            return;
+        }
+    }
+}
+
+static bool outputs_done()
+{
+    bool done = true;
+    int i, l;
+
+    for (i = 0; i < NUM_OUT; i++) {
+        pthread_mutex_lock(&outs[i].lock);
+        for (l = 0; l < 3; l++) {
+            if (outs[i].fd >= 0 && outs[i].lanes[l].next < outs[i].lanes[l].nexp)
+                done = false;
+        }
+        pthread_mutex_unlock(&outs[i].lock);
+    }
+    return done;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Original numbers for one output: span and bytes of its packets, and how
+ * long after its last chunk arrived the framing code had each packet
+ */
+static void original_stats(struct out_stream *st, uint64_t *bytes, int64_t *span_us,
+                           uint64_t *framing_avg_us)
+{
+    struct replay_event *ev, *first = NULL, *last = NULL;
+    uint64_t sum = 0;
+    int i, n = 0;
+
+    *bytes = 0;
+    for (i = 0; i < st->nexp; i++) {
+        ev = &events[st->expected[i]];
+        if (first == NULL)
+            first = ev;
+        last = ev;
+        *bytes += ev->hdr.len;
+        if (ev->src >= 0) {
+            sum += ev->hdr.ts_us - events[ev->src].hdr.ts_us;
+            n++;
+        }
+    }
+    *span_us = first ? (int64_t)(last->hdr.ts_us - first->hdr.ts_us) : 0;
+    *framing_avg_us = n ? sum / n : 0;
+}
+
+static double kbps(uint64_t bytes, int64_t span_us)
+{
+    return span_us > 0 ? bytes * 1000000.0 / span_us / 1024 : 0;
+}
+
+static bool report()
+{
+    struct out_stream *st;
+    uint64_t orig_bytes, framing_us, sum;
+    int64_t orig_span, span;
+    bool clean = true;
+    int i, j;
+
+    for (i = 0; i < NUM_OUT; i++) {
+        st = &outs[i];
+        if (st->nexp == 0 && st->unexpected == 0)
+            continue;
+        pthread_mutex_lock(&st->lock);
+        original_stats(st, &orig_bytes, &orig_span, &framing_us);
+        span = st->matched ? st->last_us - st->first_us : 0;
+        printf("%-9s %d/%d pkts, %d missing, %llu unexpected bytes\n", st->name,
+               st->matched, st->nexp, st->nexp - st->matched,
+               (unsigned long long)st->unexpected);
+        printf("          original: %llu bytes in %lld ms, %.1f KB/s, framing delay avg %llu us\n",
+               (unsigned long long)orig_bytes, (long long)orig_span / 1000,
+               kbps(orig_bytes, orig_span), (unsigned long long)framing_us);
+        if (st->matched) {
+            qsort(st->lat_us, st->matched, sizeof(uint32_t), cmp_u32);
+            for (sum = 0, j = 0; j < st->matched; j++)
+                sum += st->lat_us[j];
+            printf("          replay:   %llu bytes in %lld ms, %.1f KB/s, latency avg %llu us "
+                   "p50 %u us p99 %u us max %u us\n", (unsigned long long)st->bytes,
+                   (long long)span / 1000, kbps(st->bytes, span),
+                   (unsigned long long)(sum / st->matched), st->lat_us[st->matched / 2],
+                   st->lat_us[st->matched * 99 / 100], st->lat_us[st->matched - 1]);
+        }
+        if (st->matched != st->nexp || st->unexpected)
+            clean = false;
+        pthread_mutex_unlock(&st->lock);
+    }
+    return clean;
+}
+
+/* What the filter runs with unless -p says otherwise. Everything that
+ * changes what comes out of it, or reaches beyond it, is pinned.
+ */
+static const char *filter_props[] = {
+    "rsp_cache=0",
+    "record_path=",
+    "handover=0",
+    "hooks=",
+    "diag=off",
+    "shm_ring=0",
+    "zero_copy=0",
+    "acl_sched=0",
+    "coalesce_bt_us=0",
+    "coalesce_ant_us=0",
+    "io_backend=select",
+    "uart_profile=default",
+    "stats_interval_ms=0",
+};
+
+#define NUM_FILTER_PROPS (sizeof(filter_props)/sizeof(filter_props[0]))
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-f] [-i instance] [-p name=value]... recording "
+            "[filter_binary]\n"
+            "  -f  replay as fast as possible instead of at the recorded timing\n"
+            "  -i  filter instance of the recording to replay (default 0)\n"
+            "  -p  run the filter with vendor.wc_transport.<name> set to value\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *filter = DEFAULT_FILTER;
+    const char *user_props[REPLAY_MAX_PROPS];
+    const char *filter_argv[2 * (NUM_FILTER_PROPS + REPLAY_MAX_PROPS + 1) + 2];
+    char slave[64], uart_devices[80];
+    int num_user_props = 0, argc_filter = 0, fd;
+    int in_fds[3] = { -1, -1, -1 };
+    bool fast = false, has_ant = false, clean;
+    int instance = 0, opt, i;
+    int64_t start, last_progress;
+    int progress, prev_progress = -1;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "fi:p:")) != -1) {
+        switch (opt) {
+            case 'f':
+                fast = true;
+                break;
+            case 'i':
+                instance = atoi(optarg);
+                break;
+            case 'p':
+                if (strchr(optarg, '=') == NULL || num_user_props == REPLAY_MAX_PROPS) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                user_props[num_user_props++] = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (optind + 1 < argc)
+        filter = argv[optind + 1];
+
+    signal(SIGPIPE, SIG_IGN);
+    fd = socket_local_client("bt_sock", ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM);
+    if (fd >= 0) {
+        close(fd);
+        fprintf(stderr, "a filter is serving bt_sock already, stop it first\n");
+        return 2;
+    }
+    if (load_recording(argv[optind], instance) <= 0) {
+        fprintf(stderr, "nothing to replay for instance %d\n", instance);
+        return 2;
+    }
+    for (i = 0; i < num_events; i++) {
+        if (events[i].hdr.chan == HCI_REC_CHAN_ANT)
+            has_ant = true;
+    }
+
+    outs[OUT_UART].fd = in_fds[HCI_REC_CHAN_UART] = open_pty(slave, sizeof(slave));
+    if (in_fds[HCI_REC_CHAN_UART] < 0)
+        return 2;
+
+    /* Later -p options win in the filter */
+    snprintf(uart_devices, sizeof(uart_devices), "uart_devices=%s", slave);
+    filter_argv[argc_filter++] = filter;
+    filter_argv[argc_filter++] = "-p";
+    filter_argv[argc_filter++] = uart_devices;
+    for (i = 0; i < (int)NUM_FILTER_PROPS; i++) {
+        filter_argv[argc_filter++] = "-p";
+        filter_argv[argc_filter++] = filter_props[i];
+    }
+    for (i = 0; i < num_user_props; i++) {
+        filter_argv[argc_filter++] = "-p";
+        filter_argv[argc_filter++] = user_props[i];
+    }
+    filter_argv[argc_filter] = NULL;
+
+    pid = fork();
+    if (pid == 0) {
+        execv(filter, (char * const *)filter_argv);
+        fprintf(stderr, "unable to run %s: %s\n", filter, strerror(errno));
+        _exit(127);
+    }
+    if (pid < 0) {
+        fprintf(stderr, "fork: %s\n", strerror(errno));
+        return 2;
+    }
+
+    outs[OUT_BT].fd = in_fds[HCI_REC_CHAN_BT] = connect_client("bt_sock");
+    if (has_ant)
+        outs[OUT_ANT].fd = in_fds[HCI_REC_CHAN_ANT] = connect_client("ant_sock");
+    if (in_fds[HCI_REC_CHAN_BT] < 0 || (has_ant && in_fds[HCI_REC_CHAN_ANT] < 0)) {
+        clean = false;
+        goto out;
+    }
+    for (i = 0; i < NUM_OUT; i++) {
+        if (outs[i].fd >= 0)
+            pthread_create(&outs[i].thread, NULL, out_thread, &outs[i]);
+    }
+
+    printf("replaying %d records of instance %d from %s %s\n", num_events, instance,
+           argv[optind], fast ? "as fast as possible" : "at recorded timing");
+    start = now_us();
+    inject(fast, in_fds);
+
+    last_progress = now_us();
+    while (!outputs_done() && now_us() - last_progress < REPLAY_DRAIN_MS * 1000LL) {
+        usleep(10 * 1000);
+        for (progress = 0, i = 0; i < NUM_OUT; i++)
+            progress += __atomic_load_n(&outs[i].matched, __ATOMIC_RELAXED);
+        if (progress != prev_progress) {
+            prev_progress = progress;
+            last_progress = now_us();
+        }
+    }
+    printf("replay took %lld ms\n", (long long)(now_us() - start) / 1000);
+    clean = report();
+
+out:
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return clean ? 0 : 1;
+}
@@ -0,0 +1,513 @@
+/*==========================================================================
+Description
+  Shared-memory packet rings between wcnss_filter and a local client, see
+  shm_ring.h for the handshake.
+
+  One memfd holds a small header and two single-producer/single-consumer
+  rings, one per direction. Each record is a 32 bit length followed by the
+  packet, padded to 4 bytes. Both sides keep their own index privately and
+  only publish it, so a misbehaving peer can corrupt packets but not make us
+  read or write outside the mapping.
+
+  Doorbells are eventfds. A consumer sets consumer_waiting right before it
+  sleeps, and the producer rings only when it finds that flag set. While the
+  consumer is busy draining, the producer queues packets without a syscall.
+  When the doorbells come back to back, the consumer spins for a few
+  microseconds before sleeping. The spin window grows while that pays off
+  and shrinks when it does not.
+
+===========================================================================*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <cutils/log.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm_ring.h"
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+
+#define LOG_TAG "WCNSS_FILTER"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC         0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING   0x0002U
+#endif
+
+#define SHM_SPIN_MIN_US     5
+#define SHM_SPIN_MAX_US     50
+
+#define SHM_REC_LEN(len)    (4 + (((uint32_t)(len) + 3) & ~3U))
+
+#define STAT_ADD(field, val) __atomic_fetch_add(&shm_stats.field, (val), __ATOMIC_RELAXED)
+
+enum {
+    SHM_H2S = 0,
+    SHM_S2H,
+};
+
+/* Producer and consumer fields live on separate cache lines */
+struct shm_ring {
+    uint32_t head;
+    uint32_t producer_waiting;
+    uint32_t pad0[14];
+    uint32_t tail;
+    uint32_t consumer_waiting;
+    uint32_t pad1[14];
+};
+
+/* Followed by ring_size bytes of data for each ring, SHM_H2S first */
+struct shm_region {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ring_size;
+    uint32_t pad[13];
+    struct shm_ring rings[2];
+};
+
+struct shm_endpoint {
+    void *map;
+    size_t map_len;
+    uint32_t size;
+    struct shm_ring *tx;
+    struct shm_ring *rx;
+    unsigned char *tx_data;
+    unsigned char *rx_data;
+    /* private copies, never read back from the shared mapping */
+    uint32_t tx_head;
+    uint32_t rx_tail;
+    int fds[SHM_RING_NUM_FDS];
+    int tx_kick;
+    int tx_wait;
+    int rx_kick;
+    int rx_wait;
+    int spin_us;
+};
+
+static struct shm_ring_stats shm_stats;
+
+static int64_t now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int shm_memfd_create(const char *name, unsigned int flags)
+{
+#ifdef __NR_memfd_create
+    return syscall(__NR_memfd_create, name, flags);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void copy_in(struct shm_endpoint *ep, uint32_t pos, const void *src, uint32_t len)
+{
+    uint32_t off = pos & (ep->size - 1);
+    uint32_t first = ep->size - off < len ? ep->size - off : len;
+
+    memcpy(ep->tx_data + off, src, first);
+    memcpy(ep->tx_data, (const unsigned char *)src + first, len - first);
+}
+
+static void copy_out(struct shm_endpoint *ep, uint32_t pos, void *dst, uint32_t len)
+{
+    uint32_t off = pos & (ep->size - 1);
+    uint32_t first = ep->size - off < len ? ep->size - off : len;
+
+    memcpy(dst, ep->rx_data + off, first);
+    memcpy((unsigned char *)dst + first, ep->rx_data, len - first);
+}
+
+static void drain_doorbell(int efd)
+{
+    uint64_t val;
+
+    while (read(efd, &val, sizeof(val)) > 0)
+        ;
+}
+
+static void kick_peer(uint32_t *waiting, int efd)
+{
+    uint64_t one = 1;
+
+    /* Pairs with the fence in the sleeper between setting the flag and the
+     * last look at the ring
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST)) {
+        STAT_ADD(suppressed, 1);
+        return;
+    }
+    if (write(efd, &one, sizeof(one)) < 0)
+        ALOGE("%s: doorbell failed: %s", __func__, strerror(errno));
+    STAT_ADD(kicks, 1);
+}
+
+static uint32_t tx_room(struct shm_endpoint *ep)
+{
+    uint32_t used = ep->tx_head - __atomic_load_n(&ep->tx->tail, __ATOMIC_ACQUIRE);
+
+    return used > ep->size ? 0 : ep->size - used;
+}
+
+static bool rx_pending(struct shm_endpoint *ep)
+{
+    return __atomic_load_n(&ep->rx->head, __ATOMIC_ACQUIRE) != ep->rx_tail;
+}
+
+static void setup_endpoint(struct shm_endpoint *ep, bool host)
+{
+    struct shm_region *region = ep->map;
+    unsigned char *data = (unsigned char *)(region + 1);
+
+    ep->size = region->ring_size;
+    if (host) {
+        ep->tx = &region->rings[SHM_H2S];
+        ep->tx_data = data;
+        ep->rx = &region->rings[SHM_S2H];
+        ep->rx_data = data + ep->size;
+        ep->tx_kick = ep->fds[SHM_RING_FD_H2S_DATA];
+        ep->tx_wait = ep->fds[SHM_RING_FD_H2S_SPACE];
+        ep->rx_wait = ep->fds[SHM_RING_FD_S2H_DATA];
+        ep->rx_kick = ep->fds[SHM_RING_FD_S2H_SPACE];
+    } else {
+        ep->tx = &region->rings[SHM_S2H];
+        ep->tx_data = data + ep->size;
+        ep->rx = &region->rings[SHM_H2S];
+        ep->rx_data = data;
+        ep->tx_kick = ep->fds[SHM_RING_FD_S2H_DATA];
+        ep->tx_wait = ep->fds[SHM_RING_FD_S2H_SPACE];
+        ep->rx_wait = ep->fds[SHM_RING_FD_H2S_DATA];
+        ep->rx_kick = ep->fds[SHM_RING_FD_H2S_SPACE];
+    }
+    ep->tx_head = __atomic_load_n(&ep->tx->head, __ATOMIC_RELAXED);
+    ep->rx_tail = __atomic_load_n(&ep->rx->tail, __ATOMIC_RELAXED);
+}
+
+struct shm_endpoint *shm_ring_create(size_t ring_size)
+{
+    struct shm_endpoint *ep;
+    struct shm_region *region;
+    int i;
+
+    if (ring_size < 4096 || (ring_size & (ring_size - 1)) || ring_size > (1U << 30)) {
+        ALOGE("%s: invalid ring size %zu", __func__, ring_size);
+        return NULL;
+    }
+
+    ep = calloc(1, sizeof(*ep));
+    if (ep == NULL)
+        return NULL;
+    for (i = 0; i < SHM_RING_NUM_FDS; i++)
+        ep->fds[i] = -1;
+    ep->map = MAP_FAILED;
+    ep->map_len = sizeof(struct shm_region) + 2 * ring_size;
+
+    ep->fds[SHM_RING_FD_MEM] = shm_memfd_create("wcnss_shm_ring",
+                                                MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (ep->fds[SHM_RING_FD_MEM] < 0) {
+        ALOGE("%s: memfd_create failed: %s", __func__, strerror(errno));
+        goto fail;
+    }
+    /* The client must not be able to shrink it under our mapping */
+    if (ftruncate(ep->fds[SHM_RING_FD_MEM], ep->map_len) < 0 ||
+        fcntl(ep->fds[SHM_RING_FD_MEM], F_ADD_SEALS,
+              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        ALOGE("%s: unable to size/seal memfd: %s", __func__, strerror(errno));
+        goto fail;
+    }
+    for (i = SHM_RING_FD_MEM + 1; i < SHM_RING_NUM_FDS; i++) {
+        ep->fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (ep->fds[i] < 0) {
+            ALOGE("%s: eventfd failed: %s", __func__, strerror(errno));
+            goto fail;
+        }
+    }
+
+    ep->map = mmap(NULL, ep->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   ep->fds[SHM_RING_FD_MEM], 0);
+    if (ep->map == MAP_FAILED) {
+        ALOGE("%s: mmap failed: %s", __func__, strerror(errno));
+        goto fail;
+    }
+
+    region = ep->map;
+    region->magic = SHM_RING_MAGIC;
+    region->version = SHM_RING_VERSION;
+    region->ring_size = ring_size;
+    setup_endpoint(ep, false);
+    return ep;
+
+fail:
+    shm_ring_destroy(ep);
+    return NULL;
+}
+
+struct shm_endpoint *shm_ring_attach(const int *fds, int nfds)
+{
+    struct shm_endpoint *ep;
+    struct shm_region *region;
+    struct stat st;
+    int i;
+
+    if (nfds != SHM_RING_NUM_FDS) {
+        errno = EINVAL;
+        for (i = 0; i < nfds; i++)
+            close(fds[i]);
+        return NULL;
+    }
+
+    ep = calloc(1, sizeof(*ep));
+    if (ep == NULL)
+        return NULL;
+    memcpy(ep->fds, fds, sizeof(ep->fds));
+    ep->map = MAP_FAILED;
+
+    if (fstat(ep->fds[SHM_RING_FD_MEM], &st) < 0 ||
+        (size_t)st.st_size < sizeof(struct shm_region)) {
+        errno = EINVAL;
+        goto fail;
+    }
+    ep->map_len = st.st_size;
+    ep->map = mmap(NULL, ep->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   ep->fds[SHM_RING_FD_MEM], 0);
+    if (ep->map == MAP_FAILED)
+        goto fail;
+
+    region = ep->map;
+    if (region->magic != SHM_RING_MAGIC || region->version != SHM_RING_VERSION ||
+        region->ring_size == 0 || (region->ring_size & (region->ring_size - 1)) ||
+        ep->map_len < sizeof(*region) + 2 * (size_t)region->ring_size) {
+        errno = EPROTO;
+        goto fail;
+    }
+    setup_endpoint(ep, true);
+    return ep;
+
+fail:
+    shm_ring_destroy(ep);
+    return NULL;
+}
+
+void shm_ring_destroy(struct shm_endpoint *ep)
+{
+    int i;
+
+    if (ep == NULL)
+        return;
+    if (ep->map != MAP_FAILED)
+        munmap(ep->map, ep->map_len);
+    for (i = 0; i < SHM_RING_NUM_FDS; i++) {
+        if (ep->fds[i] >= 0)
+            close(ep->fds[i]);
+    }
+    free(ep);
+}
+
+int shm_ring_offer(struct shm_endpoint *ep, int sock, unsigned char byte)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * SHM_RING_NUM_FDS)];
+    } ctrl;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int ret;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (ep != NULL) {
+        memset(&ctrl, 0, sizeof(ctrl));
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof(ctrl.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * SHM_RING_NUM_FDS);
+        memcpy(CMSG_DATA(cmsg), ep->fds, sizeof(int) * SHM_RING_NUM_FDS);
+    }
+
+    do {
+        ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+    return ret < 0 ? -1 : 1;
+}
+
+/* Producer side of a full ring: sleep until the consumer frees some space */
+static int wait_for_room(struct shm_endpoint *ep, int ctrl_fd, uint32_t rec)
+{
+    struct pollfd pfd[2];
+    int ret;
+
+    __atomic_store_n(&ep->tx->producer_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (tx_room(ep) >= rec) {
+        __atomic_store_n(&ep->tx->producer_waiting, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    STAT_ADD(full_waits, 1);
+    pfd[0].fd = ep->tx_wait;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = ctrl_fd;
+    pfd[1].events = POLLRDHUP;
+    ret = poll(pfd, 2, -1);
+    __atomic_store_n(&ep->tx->producer_waiting, 0, __ATOMIC_RELAXED);
+    if (ret < 0)
+        return -1;
+    if (pfd[1].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+        errno = EPIPE;
+        return -1;
+    }
+    if (pfd[0].revents & POLLIN)
+        drain_doorbell(ep->tx_wait);
+    return 0;
+}
+
+int shm_ring_send(struct shm_endpoint *ep, int ctrl_fd, const unsigned char *buf,
+                  int len)
+{
+    uint32_t rec = SHM_REC_LEN(len);
+    uint32_t len32 = len;
+
+    if (len <= 0 || rec > ep->size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    while (tx_room(ep) < rec) {
+        if (wait_for_room(ep, ctrl_fd, rec) < 0)
+            return -1;
+    }
+
+    copy_in(ep, ep->tx_head, &len32, sizeof(len32));
+    copy_in(ep, ep->tx_head + sizeof(len32), buf, len);
+    ep->tx_head += rec;
+    __atomic_store_n(&ep->tx->head, ep->tx_head, __ATOMIC_RELEASE);
+    STAT_ADD(tx_pkts, 1);
+
+    kick_peer(&ep->tx->consumer_waiting, ep->tx_kick);
+    return len;
+}
+
+int shm_ring_recv(struct shm_endpoint *ep, unsigned char *buf, int len)
+{
+    uint32_t head = __atomic_load_n(&ep->rx->head, __ATOMIC_ACQUIRE);
+    uint32_t avail = head - ep->rx_tail;
+    uint32_t pkt_len, rec;
+
+    if (avail == 0)
+        return 0;
+    if (avail > ep->size || avail < sizeof(pkt_len)) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    copy_out(ep, ep->rx_tail, &pkt_len, sizeof(pkt_len));
+    rec = SHM_REC_LEN(pkt_len);
+    if (pkt_len == 0 || pkt_len > ep->size || rec > avail) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    if (pkt_len <= (uint32_t)len)
+        copy_out(ep, ep->rx_tail + sizeof(pkt_len), buf, pkt_len);
+    ep->rx_tail += rec;
+    __atomic_store_n(&ep->rx->tail, ep->rx_tail, __ATOMIC_RELEASE);
+    kick_peer(&ep->rx->producer_waiting, ep->rx_kick);
+
+    if (pkt_len > (uint32_t)len) {
+        /* Skipped, the ring itself is still in sync */
+        errno = EMSGSIZE;
+        return -1;
+    }
+    STAT_ADD(rx_pkts, 1);
+    return pkt_len;
+}
+
+int shm_ring_wait(struct shm_endpoint *ep, int ctrl_fd)
+{
+    struct pollfd pfd[2];
+    int64_t start, slept;
+    int ret, mask = 0;
+
+    if (rx_pending(ep))
+        return SHM_RING_READY;
+
+    if (ep->spin_us > 0) {
+        start = now_us();
+        while (now_us() - start < ep->spin_us) {
+            if (rx_pending(ep)) {
+                ep->spin_us = ep->spin_us * 2 < SHM_SPIN_MAX_US ?
+                              ep->spin_us * 2 : SHM_SPIN_MAX_US;
+                return SHM_RING_READY;
+            }
+        }
+        ep->spin_us /= 2;
+    }
+
+    __atomic_store_n(&ep->rx->consumer_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (rx_pending(ep)) {
+        __atomic_store_n(&ep->rx->consumer_waiting, 0, __ATOMIC_RELAXED);
+        return SHM_RING_READY;
+    }
+
+    pfd[0].fd = ctrl_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = ep->rx_wait;
+    pfd[1].events = POLLIN;
+    start = now_us();
+    ret = poll(pfd, 2, -1);
+    __atomic_store_n(&ep->rx->consumer_waiting, 0, __ATOMIC_RELAXED);
+    if (ret < 0)
+        return -1;
+
+    if (pfd[1].revents & POLLIN) {
+        drain_doorbell(ep->rx_wait);
+        /* Woken again right away: the next gap is likely short as well */
+        slept = now_us() - start;
+        if (slept < SHM_SPIN_MAX_US)
+            ep->spin_us = ep->spin_us < SHM_SPIN_MIN_US ? SHM_SPIN_MIN_US :
+                          (ep->spin_us * 2 < SHM_SPIN_MAX_US ? ep->spin_us * 2 :
+                           SHM_SPIN_MAX_US);
+    }
+    if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))
+        mask |= SHM_RING_CTRL;
+    if (rx_pending(ep))
+        mask |= SHM_RING_READY;
+    return mask;
+}
+
+void shm_ring_get_stats(struct shm_ring_stats *st)
+{
+    st->tx_pkts = __atomic_load_n(&shm_stats.tx_pkts, __ATOMIC_RELAXED);
+    st->rx_pkts = __atomic_load_n(&shm_stats.rx_pkts, __ATOMIC_RELAXED);
+    st->kicks = __atomic_load_n(&shm_stats.kicks, __ATOMIC_RELAXED);
+    st->suppressed = __atomic_load_n(&shm_stats.suppressed, __ATOMIC_RELAXED);
+    st->full_waits = __atomic_load_n(&shm_stats.full_waits, __ATOMIC_RELAXED);
+}
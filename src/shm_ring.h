@@ -0,0 +1,85 @@
+/*==========================================================================
+Description
+  Shared-memory packet rings between wcnss_filter and a local client.
+
+  A client asks for them by sending SHM_RING_REQUEST on its socket. The filter
+  answers with the same byte, carrying the memfd and the doorbell eventfds as
+  SCM_RIGHTS, in SHM_RING_FD_* order. When no fds come with the answer, the
+  request was refused and the socket stays the data path. The client must
+  therefore read the answer with recvmsg().
+
+  From the answer on, the client reads complete packets from the SoC-to-host
+  ring and queues complete packets on the host-to-SoC ring. The bytes are the
+  same as on the socket. The socket itself remains the control channel: it
+  carries BT_SSR_TRIGGERED, close detection, and any packet the client still
+  chooses to send through it.
+
+===========================================================================*/
+
+#ifndef WCNSS_FILTER_SHM_RING_H
+#define WCNSS_FILTER_SHM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_RING_REQUEST    0xed
+
+#define SHM_RING_MAGIC      0x57435352  /* "WCSR" */
+#define SHM_RING_VERSION    1
+
+enum {
+    SHM_RING_FD_MEM = 0,
+    SHM_RING_FD_H2S_DATA,   /* host queued packets */
+    SHM_RING_FD_H2S_SPACE,  /* filter freed host-to-SoC space */
+    SHM_RING_FD_S2H_DATA,   /* filter queued packets */
+    SHM_RING_FD_S2H_SPACE,  /* host freed SoC-to-host space */
+    SHM_RING_NUM_FDS,
+};
+
+/* shm_ring_wait() results */
+#define SHM_RING_READY  0x1   /* packets are waiting in the rx ring */
+#define SHM_RING_CTRL   0x2   /* the control socket is readable */
+
+struct shm_endpoint;
+
+struct shm_ring_stats {
+    uint64_t tx_pkts;
+    uint64_t rx_pkts;
+    uint64_t kicks;         /* doorbells rung */
+    uint64_t suppressed;    /* doorbells skipped, peer was not sleeping */
+    uint64_t full_waits;    /* producer had to wait for space */
+};
+
+/* Filter side: allocates both rings, ring_size bytes each (power of two) */
+struct shm_endpoint *shm_ring_create(size_t ring_size);
+
+/* Host side: maps what the filter handed over, takes ownership of fds */
+struct shm_endpoint *shm_ring_attach(const int *fds, int nfds);
+
+void shm_ring_destroy(struct shm_endpoint *ep);
+
+/* Sends byte over sock with the endpoint's fds attached, or none if ep is
+ * NULL. Returns 1 on success, -1 with errno set otherwise.
+ */
+int shm_ring_offer(struct shm_endpoint *ep, int sock, unsigned char byte);
+
+/* Queues one packet, waiting for room if the ring is full. ctrl_fd is only
+ * watched for hangup while waiting. Returns len or -1 with errno set.
+ */
+int shm_ring_send(struct shm_endpoint *ep, int ctrl_fd, const unsigned char *buf,
+                  int len);
+
+/* Dequeues one packet into buf. Returns its length, 0 when the ring is empty
+ * or -1 (EBADMSG, EMSGSIZE) when the peer wrote something that is not a
+ * packet of at most len bytes.
+ */
+int shm_ring_recv(struct shm_endpoint *ep, unsigned char *buf, int len);
+
+/* Blocks until the rx ring has packets or ctrl_fd is readable. Returns a
+ * SHM_RING_READY/SHM_RING_CTRL mask or -1 with errno set.
+ */
+int shm_ring_wait(struct shm_endpoint *ep, int ctrl_fd);
+
+void shm_ring_get_stats(struct shm_ring_stats *st);
+
+#endif //WCNSS_FILTER_SHM_RING_H
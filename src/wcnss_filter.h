@@ -0,0 +1,64 @@
+/*==========================================================================
+Description
+  libwcnss_filter: the wcnss_filter mux/demux core, linked into the
+  Bluetooth stack's process instead of running as its own executable.
+
+  The stack takes the place of the bt_sock client of the first UART. It gets
+  framed H4 packets by callback and hands packets to the controller by
+  function call, with no socket hop in between. ANT and any further UARTs
+  are still served over their sockets from the stack's process. Everything
+  else (vendor.wc_transport.* properties, watchdog, recovery) behaves as in
+  the executable. The watchdog takes the first real-time signal without a
+  handler and its threads block SIGPIPE; the process-wide SIGPIPE and SIGUSR1
+  dispositions are left alone. Only the wcnss_filter_* functions are exported.
+
+===========================================================================*/
+
+#ifndef WCNSS_FILTER_H
+#define WCNSS_FILTER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WCNSS_FILTER_API __attribute__((visibility("default")))
+
+struct wcnss_filter_callbacks {
+    /* One complete H4 packet for the host, packet type byte first. Runs on
+     * the UART reader thread; buf is only valid during the call. It also
+     * runs from within wcnss_filter_send_bt() when the filter answers a
+     * command from its response cache.
+     */
+    void (*bt_recv)(void *ctx, const unsigned char *buf, int len);
+    /* The controller is being re-initialized, same as BT_SSR_TRIGGERED on
+     * bt_sock, or the UART is lost for good when re-initializing it failed;
+     * wcnss_filter_send_bt() then fails with EIO. Optional.
+     */
+    void (*bt_ssr)(void *ctx);
+};
+
+/* Starts the filter on first use and routes BT of the first UART to cb,
+ * which is copied. Returns 0, or -1 if the filter could not start (a UART
+ * that does not open included), callbacks are already attached or the
+ * UART has been lost since (EIO).
+ */
+WCNSS_FILTER_API int wcnss_filter_start(const struct wcnss_filter_callbacks *cb, void *ctx);
+
+/* Sends one complete H4 packet (command, ACL or SCO) to the controller, or
+ * the single byte BT_SSR_TRIGGERED (0xee) to request a recovery. Blocks
+ * while the UART is busy. Returns len or -1 with errno set, EIO once the
+ * UART is lost.
+ */
+WCNSS_FILTER_API int wcnss_filter_send_bt(const unsigned char *buf, int len);
+
+/* Detaches the callbacks; BT traffic from the controller is dropped as if
+ * the client had closed bt_sock. No callback runs once this returned,
+ * unless it is called from within one. The filter threads keep running.
+ */
+WCNSS_FILTER_API void wcnss_filter_stop();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //WCNSS_FILTER_H